@@ -122,23 +122,29 @@ namespace DarkId::Papyrus::DebugServer
 
 	bool ArrayStateNode::GetChildNode(std::string name, std::shared_ptr<StateNodeBase>& node)
 	{
-		if (!m_value)
-		{
-			return false;
-		}
-		
 		int elementIndex;
-		if (!ParseInt(name, &elementIndex))
+		if (!ParseInt(name, &elementIndex) || elementIndex < 0)
 		{
 			return false;
 		}
-		if (elementIndex < 0 || ((uint32_t)elementIndex) > m_value->size() - 1)
+
+		return GetElementNode(static_cast<uint32_t>(elementIndex), node);
+	}
+
+	uint32_t ArrayStateNode::GetElementCount()
+	{
+		return m_value ? m_value->size() : 0;
+	}
+
+	bool ArrayStateNode::GetElementNode(const uint32_t index, std::shared_ptr<StateNodeBase>& node)
+	{
+		if (!m_value || index >= m_value->size())
 		{
 			return false;
 		}
 
-		node = RuntimeState::CreateNodeForVariable(std::to_string(elementIndex), &(*m_value)[elementIndex]);
-		
-		return true;
+		node = RuntimeState::CreateNodeForVariable(std::to_string(index), &(*m_value)[index]);
+
+		return node != nullptr;
 	}
 }
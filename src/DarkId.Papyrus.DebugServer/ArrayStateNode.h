@@ -7,7 +7,7 @@
 
 namespace DarkId::Papyrus::DebugServer
 {
-	class ArrayStateNode : public StateNodeBase, public IProtocolVariableSerializable, public IStructuredState
+	class ArrayStateNode : public StateNodeBase, public IProtocolVariableSerializable, public IStructuredState, public IIndexedState
 	{
 		std::string m_name;
 
@@ -24,5 +24,8 @@ namespace DarkId::Papyrus::DebugServer
 
 		bool GetChildNames(std::vector<std::string>& names) override;
 		bool GetChildNode(std::string name, std::shared_ptr<StateNodeBase>& node) override;
+
+		uint32_t GetElementCount() override;
+		bool GetElementNode(uint32_t index, std::shared_ptr<StateNodeBase>& node) override;
 	};
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "BreakpointManager.h"
 #include <Champollion/Pex/Binary.hpp>
+#include <algorithm>
 #include <regex>
 #include "Utilities.h"
 #include "Pex.h"
@@ -10,25 +11,35 @@
 namespace DarkId::Papyrus::DebugServer
 {
 
+	// Versions are unique across sessions, so a thread's cached table from an earlier BreakpointManager never matches
+	std::atomic<uint64_t> g_functionBreakpointsVersion = 0;
+
+	struct CachedFunctionBreakpoints
+	{
+		uint64_t version = 0;
+		std::shared_ptr<const FunctionBreakpointTable> table;
+	};
+	thread_local CachedFunctionBreakpoints t_functionBreakpoints;
+
 	int64_t GetBreakpointID(int scriptReference, int lineNumber) {
 		return (((int64_t)scriptReference) << 32) + lineNumber;
 	}
 
-	std::string GetInstructionReference(const Pex::DebugInfo::FunctionInfo& finfo) {
-		return std::format("{}:{}:{}", finfo.getObjectName().asString(), finfo.getStateName().asString(), finfo.getFunctionName().asString());
+	std::string GetInstructionReference(const FunctionDebugInfo& finfo) {
+		return std::format("{}:{}:{}", finfo.objectName, finfo.stateName, finfo.functionName);
 	}
 
 	dap::ResponseOrError<dap::SetBreakpointsResponse> BreakpointManager::SetBreakpoints(const dap::Source& source, const std::vector<dap::SourceBreakpoint>& srcBreakpoints)
 	{
 		dap::SetBreakpointsResponse response;
-		std::set<int> breakpointLines;
-		auto scriptName = NormalizeScriptName(source.name.value(""));
-		auto binary = m_pexCache->GetScript(scriptName.c_str());
-		if (!binary) {
+		const auto& identity = ScriptIdentityCache::GetSingleton().Get(source.name.value(""));
+		const auto& scriptName = identity.normalizedName;
+		auto debugInfo = m_pexCache->GetDebugInfo(identity);
+		if (!debugInfo) {
 			RETURN_DAP_ERROR(std::format("SetBreakpoints: Could not find PEX data for script {}", scriptName));
 		}
 		auto ref = GetSourceReference(source);
-		bool hasDebugInfo = binary->getDebugInfo().getFunctionInfos().size() > 0;
+		bool hasDebugInfo = debugInfo->functions.size() > 0;
 		
 		if (!hasDebugInfo) {
 #if FALLOUT
@@ -42,56 +53,33 @@ namespace DarkId::Papyrus::DebugServer
 		ScriptBreakpoints info {
 		   .ref = ref,
 		   .source = source,
-		   .modificationTime = binary->getDebugInfo().getModificationTime()
+		   .modificationTime = debugInfo->modificationTime
 		};
-		std::map<int, BreakpointInfo> foundBreakpoints;
+		const auto lineIndex = m_pexCache->GetLineIndex(identity);
+		const auto& funcInfos = debugInfo->functions;
 		
 		for (const auto& srcBreakpoint : srcBreakpoints)
 		{
-			auto foundLine = false;
 			int line = static_cast<int>(srcBreakpoint.line);
-			int instructionNum = -1;
-			int foundFunctionInfoIndex{-1};
-			Pex::DebugInfo::FunctionInfo debugfinfo;
-			int64_t breakpointId = -1;
-			if (binary)
-			{
-				auto& funcInfos = binary->getDebugInfo().getFunctionInfos();
-				for (int j = 0; j < funcInfos.size(); j++)
-				{
-					if (foundLine)
-					{
-						break;
-					}
-					for (int i = 0; i < funcInfos[j].getLineNumbers().size(); i++)
-					{
-						auto lineNumber = funcInfos[j].getLineNumbers()[i];
-						if (line == static_cast<int>(lineNumber))
-						{
-							foundLine = true;
-							instructionNum = i;
-							foundFunctionInfoIndex = j;
-							debugfinfo = funcInfos[j];
-							break;
-						}
-					}
-				}
-			}
-			breakpointId = GetBreakpointID(ref, line);
+			// the first function with code on the line wins
+			const auto locations = line > 0 && lineIndex ? lineIndex->GetLocations(static_cast<uint32_t>(line)) : std::span<const PexLineIndex::Location>();
+			const auto foundLine = !locations.empty();
+			int64_t breakpointId = GetBreakpointID(ref, line);
+			int instructionNum = foundLine ? static_cast<int>(locations.front().instruction) : -1;
 
 			if (foundLine) {
 				auto bpoint = BreakpointInfo{
 					.breakpointId = breakpointId,
 					.instructionNum = instructionNum,
 					.lineNum = line,
-					.debugFuncInfoIndex = foundFunctionInfoIndex
+					.debugFuncInfoIndex = static_cast<int>(locations.front().functionInfoIndex)
 				};
 				info.breakpoints[instructionNum] = bpoint;
 			}
 
 			response.breakpoints.push_back( dap::Breakpoint {
 				.id = foundLine ? dap::integer(breakpointId) : dap::optional<dap::integer>(),
-				.instructionReference = foundLine ? GetInstructionReference(debugfinfo) : dap::optional<dap::string>(),
+				.instructionReference = foundLine ? GetInstructionReference(funcInfos[locations.front().functionInfoIndex]) : dap::optional<dap::string>(),
 				.line = dap::integer(line),
 				.offset = foundLine ? dap::integer(instructionNum) : dap::optional<dap::integer>(),
 				.source = source,
@@ -99,17 +87,63 @@ namespace DarkId::Papyrus::DebugServer
 				});
 		}
 
+		// keep scripts we have breakpoints in from being evicted while the session uses them
+		m_pexCache->SetPinned(ref, !info.breakpoints.empty());
+
+		std::unique_lock lock(m_breakpointsMutex);
 		m_breakpoints[ref] = info;
+		PublishFunctionBreakpoints(std::make_shared<const FunctionBreakpointTable>());
+		return response;
+	}
+
+	dap::ResponseOrError<dap::BreakpointLocationsResponse> BreakpointManager::GetBreakpointLocations(const dap::Source& source, const int line, const int endLine)
+	{
+		dap::BreakpointLocationsResponse response;
+		const auto& identity = ScriptIdentityCache::GetSingleton().Get(source.name.value(""));
+		const auto lineIndex = m_pexCache->GetLineIndex(identity);
+		if (!lineIndex) {
+			RETURN_DAP_ERROR(std::format("BreakpointLocations: Could not find PEX data for script {}", identity.normalizedName));
+		}
+		if (line <= 0 || endLine < line) {
+			return response;
+		}
+
+		int lastLine = -1;
+		for (const auto& location : lineIndex->GetLocations(static_cast<uint32_t>(line), static_cast<uint32_t>(endLine)))
+		{
+			// several functions can share a line (e.g. a state's override), report it once
+			if (static_cast<int>(location.line) == lastLine)
+			{
+				continue;
+			}
+			lastLine = static_cast<int>(location.line);
+			response.breakpoints.push_back(dap::BreakpointLocation{ .line = dap::integer(lastLine) });
+		}
 		return response;
 	}
 
 	void BreakpointManager::ClearBreakpoints(bool emitChanged) {
+		std::unique_lock lock(m_breakpointsMutex);
 		if (emitChanged) {
+			std::vector<int> refs;
 			for (auto & kv : m_breakpoints) {
-				InvalidateAllBreakpointsForScript(kv.first);
+				refs.push_back(kv.first);
+			}
+			for (const auto ref : refs) {
+				InvalidateAllBreakpointsForScriptInternal(ref);
 			}
 		}
 		m_breakpoints.clear();
+		PublishFunctionBreakpoints(std::make_shared<const FunctionBreakpointTable>());
+		m_pexCache->ClearPinned();
+	}
+
+	bool BreakpointManager::HasBreakpoints() const
+	{
+		std::shared_lock lock(m_breakpointsMutex);
+		return std::any_of(m_breakpoints.begin(), m_breakpoints.end(), [](const auto& kv) {
+			return !kv.second.breakpoints.empty();
+		});
 	}
 
 	// TODO: Upstream this
@@ -120,21 +154,66 @@ namespace DarkId::Papyrus::DebugServer
 	}
 
 	void BreakpointManager::InvalidateAllBreakpointsForScript(int ref) {
-		if (m_breakpoints.find(ref) != m_breakpoints.end())
+		std::unique_lock lock(m_breakpointsMutex);
+		InvalidateAllBreakpointsForScriptInternal(ref);
+	}
+
+	void BreakpointManager::InvalidateAllBreakpointsForScriptInternal(int ref) {
+		const auto scriptBreakpoints = m_breakpoints.find(ref);
+		if (scriptBreakpoints == m_breakpoints.end())
 		{
 			return;
 		}
-		for (auto& KV : m_breakpoints[ref].breakpoints) 
+		for (auto& KV : scriptBreakpoints->second.breakpoints) 
 		{
 			auto bpinfo = KV.second;
 			RuntimeEvents::EmitBreakpointChangedEvent(dap::Breakpoint{
 				.id = bpinfo.breakpointId,
 				.line = bpinfo.lineNum,
-				.source = m_breakpoints[ref].source,
+				.source = scriptBreakpoints->second.source,
 				.verified = false
 				}, "changed");
 		}
-		m_breakpoints.erase(ref);
+		m_breakpoints.erase(scriptBreakpoints);
+		PublishFunctionBreakpoints(std::make_shared<const FunctionBreakpointTable>());
+		m_pexCache->SetPinned(ref, false);
+	}
+
+	void BreakpointManager::PublishFunctionBreakpoints(std::shared_ptr<const FunctionBreakpointTable> table)
+	{
+		// the table goes first, so a thread that sees the new version loads at least this table
+		m_functionBreakpoints.store(std::move(table));
+		m_functionBreakpointsVersion.store(++g_functionBreakpointsVersion, std::memory_order_release);
+	}
+
+	std::vector<uint64_t> BreakpointManager::CompileFunctionBreakpoints(RE::BSScript::Internal::ScriptFunction* func, RE::BSScript::ObjectTypeInfo* objectType)
+	{
+		std::vector<uint64_t> instructionBits;
+		const auto sourceReference = static_cast<int>(ScriptIdentityCache::GetSingleton().Get(objectType).id);
+		const auto scriptBreakpoints = m_breakpoints.find(sourceReference);
+		if (scriptBreakpoints == m_breakpoints.end() || scriptBreakpoints->second.breakpoints.empty())
+		{
+			return instructionBits;
+		}
+
+		auto debugInfo = m_pexCache->GetCachedDebugInfo(sourceReference);
+		if (!debugInfo || debugInfo->modificationTime != scriptBreakpoints->second.modificationTime) {
+			// script was reloaded or removed after placement, remove it
+			InvalidateAllBreakpointsForScriptInternal(sourceReference);
+			return instructionBits;
+		}
+
+		const auto& funcInfos = debugInfo->functions;
+		for (const auto& [instructionNum, breakpointInfo] : scriptBreakpoints->second.breakpoints)
+		{
+			const auto& funcInfo = funcInfos[breakpointInfo.debugFuncInfoIndex];
+			if (CaseInsensitiveEquals(funcInfo.functionName, func->GetName().c_str()) &&
+				CaseInsensitiveEquals(funcInfo.stateName, func->GetStateName().c_str()))
+			{
+				FunctionBreakpointTable::SetInstructionBit(instructionBits, static_cast<uint32_t>(breakpointInfo.instructionNum));
+			}
+		}
+		return instructionBits;
 	}
 
 	bool BreakpointManager::GetExecutionIsAtValidBreakpoint(RE::BSScript::Internal::CodeTasklet* tasklet)
@@ -146,31 +225,40 @@ namespace DarkId::Papyrus::DebugServer
 		}
 		// only ScriptFunctions are non-native
 		auto func = static_cast<RE::BSScript::Internal::ScriptFunction*>(_func.get());
-		const auto sourceReference = GetScriptReference(tasklet->topFrame->owningObjectType->GetName());
-		
-		if (m_breakpoints.find(sourceReference) != m_breakpoints.end())
+
+		// Loading an atomic shared_ptr takes a lock and a reference count, which every VM thread would fight over on
+		// every instruction. Each thread keeps its own reference instead, and only reloads when the table changes.
+		auto& cached = t_functionBreakpoints;
+		const auto version = m_functionBreakpointsVersion.load(std::memory_order_acquire);
+		if (cached.version != version)
 		{
-			auto& scriptBreakpoints = m_breakpoints[sourceReference];
+			cached.table = m_functionBreakpoints.load();
+			cached.version = version;
+		}
 
-			auto binary = m_pexCache->GetCachedScript(sourceReference);
-			if (!binary || binary->getDebugInfo().getModificationTime() != scriptBreakpoints.modificationTime) {
-				// script was reloaded or removed after placement, remove it
-				InvalidateAllBreakpointsForScript(sourceReference);
-				return false;
-			}
-			if (!scriptBreakpoints.breakpoints.empty())
+		auto entry = cached.table->Find(func);
+		if (!entry)
+		{
+			// first time this function has run since the breakpoints changed
+			std::unique_lock lock(m_breakpointsMutex);
+			auto table = m_functionBreakpoints.load();
+			// another thread may have compiled it while we were waiting for the lock
+			entry = table->Find(func);
+			if (!entry)
 			{
-				int currentInstruction = -1;
-				auto ip = tasklet->topFrame->STACK_FRAME_IP;
-				currentInstruction = GetInstructionNumberForOffset(&func->instructions, ip);
-				if (currentInstruction != -1 && scriptBreakpoints.breakpoints.find(currentInstruction) != scriptBreakpoints.breakpoints.end()) {
-					return true;
-				}
-				return false;
+				auto instructionBits = CompileFunctionBreakpoints(func, tasklet->topFrame->owningObjectType.get());
+				// compiling can invalidate a reloaded script and publish an empty table, so copy whatever is current now
+				auto updated = std::make_shared<FunctionBreakpointTable>(*m_functionBreakpoints.load());
+				entry = updated->Insert(func, std::move(instructionBits));
+				table = updated;
+				PublishFunctionBreakpoints(std::move(updated));
 			}
+			cached.table = std::move(table);
+			cached.version = m_functionBreakpointsVersion.load(std::memory_order_acquire);
 		}
 
-		return false;
+		return entry->HasBreakpoints() &&
+			entry->HasBreakpointAt(GetInstructionNumberForOffset(&func->instructions, tasklet->topFrame->STACK_FRAME_IP));
 	}
 
 	//TODO: WIP
@@ -185,22 +273,24 @@ namespace DarkId::Papyrus::DebugServer
 
 		int instNum = GetInstructionNumberForOffset(&realfunc->instructions, tasklet->topFrame->STACK_FRAME_IP);
 
-		std::string scriptName(tasklet->topFrame->owningObjectType->GetName());
-		const auto sourceReference = GetScriptReference(scriptName);
+		const auto& identity = ScriptIdentityCache::GetSingleton().Get(tasklet->topFrame->owningObjectType.get());
+		const auto sourceReference = static_cast<int>(identity.id);
+		std::shared_lock lock(m_breakpointsMutex);
 		if (m_breakpoints.find(sourceReference) != m_breakpoints.end())
 		{
 			auto& scriptBreakpoints = m_breakpoints[sourceReference];
-			auto binary = m_pexCache->GetScript(scriptName);
-			if (!binary || binary->getDebugInfo().getModificationTime() != scriptBreakpoints.modificationTime) {
+			auto functionIndex = m_pexCache->GetFunctionIndex(identity);
+			if (!functionIndex || functionIndex->GetBinary()->getDebugInfo().getModificationTime() != scriptBreakpoints.modificationTime) {
 				return true;
 			}
 			if (scriptBreakpoints.breakpoints.find(instNum) != scriptBreakpoints.breakpoints.end())
 			{
 
 				auto& breakpointInfo = scriptBreakpoints.breakpoints[instNum];
-				auto& debugFuncInfo = binary->getDebugInfo().getFunctionInfos()[breakpointInfo.debugFuncInfoIndex];
-				auto& lineNumbers = debugFuncInfo.getLineNumbers();
-				auto funcData = GetFunctionData(binary, debugFuncInfo.getObjectName(), debugFuncInfo.getStateName(), debugFuncInfo.getFunctionName());
+				auto funcData = functionIndex->GetFunction(breakpointInfo.debugFuncInfoIndex);
+				if (!funcData) {
+					return true;
+				}
 				auto& instructions = funcData->getInstructions();
 				for (int i = instNum+1; i < instructions.size(); i++) {
 					auto& instruction = instructions[i];
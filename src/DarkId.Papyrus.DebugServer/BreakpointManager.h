@@ -1,12 +1,16 @@
 #pragma once
+#include <atomic>
 #include <map>
+#include <memory>
 #include <set>
+#include <shared_mutex>
 #include <dap/protocol.h>
 #include <dap/session.h>
 
 #include "GameInterfaces.h"
 
 #include "PexCache.h"
+#include "FunctionBreakpointTable.h"
 
 namespace DarkId::Papyrus::DebugServer
 {
@@ -35,13 +39,25 @@ namespace DarkId::Papyrus::DebugServer
 		}
 
 		dap::ResponseOrError<dap::SetBreakpointsResponse> SetBreakpoints(const dap::Source& src, const std::vector<dap::SourceBreakpoint>& srcBreakpoints);
+		dap::ResponseOrError<dap::BreakpointLocationsResponse> GetBreakpointLocations(const dap::Source& source, int line, int endLine);
 		void ClearBreakpoints(bool emitChanged = false);
+		bool HasBreakpoints() const;
 		bool CheckIfFunctionWillWaitOrExit(RE::BSScript::Internal::CodeTasklet* tasklet);
 		void InvalidateAllBreakpointsForScript(int ref);
 		bool GetExecutionIsAtValidBreakpoint(RE::BSScript::Internal::CodeTasklet* tasklet);
 	private:
 		PexCache* m_pexCache;
 		std::map<int, ScriptBreakpoints> m_breakpoints;
+		// Breakpoints compiled per running function; rebuilt lazily after any change to m_breakpoints.
+		// Published tables are never modified, so the hook can probe one without holding m_breakpointsMutex.
+		std::atomic<std::shared_ptr<const FunctionBreakpointTable>> m_functionBreakpoints = std::make_shared<const FunctionBreakpointTable>();
+		// Bumped after every publish; lets the hook keep its own reference instead of loading the shared_ptr each time
+		std::atomic<uint64_t> m_functionBreakpointsVersion = 0;
+		mutable std::shared_mutex m_breakpointsMutex;
+
+		void InvalidateAllBreakpointsForScriptInternal(int ref);
+		void PublishFunctionBreakpoints(std::shared_ptr<const FunctionBreakpointTable> table);
+		std::vector<uint64_t> CompileFunctionBreakpoints(RE::BSScript::Internal::ScriptFunction* func, RE::BSScript::ObjectTypeInfo* objectType);
 
 	};
 }
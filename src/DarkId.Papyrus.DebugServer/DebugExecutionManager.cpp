@@ -1,6 +1,8 @@
 #include "DebugExecutionManager.h"
-#include <thread>
+#include <algorithm>
+#include <vector>
 #include "Window.h"
+#include "RuntimeEvents.h"
 
 namespace DarkId::Papyrus::DebugServer
 {
@@ -8,166 +10,464 @@ namespace DarkId::Papyrus::DebugServer
 
 	void DebugExecutionManager::HandleInstruction(CodeTasklet* tasklet)
 	{
-		std::lock_guard<std::mutex> lock(m_instructionMutex);
+		// Nothing is armed (no breakpoints, no step, no pause), so there's nothing to check
+		if (m_armedState.load(std::memory_order_relaxed) == kArmedNone)
+		{
+			return;
+		}
 
 		if (m_closed)
 		{
 			return;
 		}
-		
-		const auto & func = tasklet->topFrame->owningFunction;
-		bool shouldContinue = false;
-		bool shouldSendEvent = false;
-		std::string pauseReason = "";
-		DebuggerState new_state = m_state;
 
-		if (m_state == DebuggerState::kPaused)
+		const auto stackId = tasklet->stack->stackID;
+		std::string pauseReason;
+
+		// A stack that's going to wait anyway doesn't need to check its step or breakpoints
+		const bool pausedByRequest = ShouldWait(stackId);
+		if (pausedByRequest)
 		{
-			pauseReason = "paused";
+			if (m_pauseEventPending.exchange(false))
+			{
+				pauseReason = "paused";
+			}
 		}
-		else if (m_state != DebuggerState::kPaused && m_breakpointManager->GetExecutionIsAtValidBreakpoint(tasklet))
+		else if (m_steppingStacks.Contains(stackId) && IsAtStepTarget(tasklet))
 		{
-			pauseReason = "breakpoint";
+			pauseReason = "step";
 		}
-		else if (m_state == DebuggerState::kStepping && !RuntimeState::GetStack(m_currentStepStackId))
+		else if (m_breakpointManager->GetExecutionIsAtValidBreakpoint(tasklet))
 		{
-			shouldContinue = true;
+			pauseReason = "breakpoint";
 		}
-		else if (m_state == DebuggerState::kStepping && tasklet->stack->stackID == m_currentStepStackId)
+
+		if (!pauseReason.empty())
 		{
-			if (m_currentStepStackFrame)
+			// another stack may have stopped everything first; then this one just parks with the rest
+			if (!Stop(stackId, pauseReason, pausedByRequest))
 			{
-				std::vector<RE::BSScript::StackFrame*> currentFrames;
-				RuntimeState::GetStackFrames(tasklet->stack->stackID, currentFrames);
-
-				if (!currentFrames.empty())
-				{
-					ptrdiff_t stepFrameIndex = -1;
-					const auto stepFrameIter = std::find(currentFrames.begin(), currentFrames.end(), m_currentStepStackFrame);
-
-					if (stepFrameIter != currentFrames.end())
-					{
-						stepFrameIndex = std::distance(currentFrames.begin(), stepFrameIter);
-					}
-
-					switch (m_currentStepType)
-					{
-					case StepType::STEP_IN:
-						pauseReason = "step";
-						break;
-					case StepType::STEP_OUT:
-						// If the stack exists, but the original frame is gone, we know we're in a previous frame now.
-						if (stepFrameIndex == -1)
-						{
-							pauseReason = "step";
-						}
-						break;
-					case StepType::STEP_OVER:
-						if (stepFrameIndex <= 0)
-						{
-							pauseReason = "step";
-						}
-						break;
-					}
-				}
+				pauseReason.clear();
 			}
 		}
-		
-		if (!pauseReason.empty())
-		{	
-			m_state = DebuggerState::kPaused;
-			m_currentStepStackId = 0;
-			m_currentStepStackFrame = nullptr;
-			if (m_session) {
-				m_session->send(dap::StoppedEvent{
-					.reason = pauseReason,
-					.threadId = tasklet->stack->stackID
-					});
-			}
-			Window::ReleaseFocus();
-		}
-		else if (shouldContinue) {
-			m_state = DebuggerState::kRunning;
-			m_currentStepStackId = 0;
-			m_currentStepStackFrame = nullptr;
-			if (m_session) {
-				m_session->send(dap::ContinuedEvent{
-				.allThreadsContinued = true,
-				.threadId = tasklet->stack->stackID
-					});
-			}
+		else if (!pausedByRequest)
+		{
+			return;
 		}
 
-		while (m_state == DebuggerState::kPaused && !m_closed)
+		// The editor opens the stack that stopped; any other stack's frames are queued if their trace is asked for
+		if (!pauseReason.empty())
 		{
-			using namespace std::chrono_literals;
-			std::this_thread::sleep_for(100ms);
+			QueueDecompilation(tasklet);
 		}
+		WaitWhilePaused(stackId);
 		// If we were the thread that paused, regain focus
 		if (!pauseReason.empty()) {
 			Window::RegainFocus();
 		}
+	}
+
+	bool DebugExecutionManager::ShouldWait(const uint32_t stackId) const
+	{
+		return m_pauseAll.load(std::memory_order_acquire) && !m_releasedStacks.Contains(stackId);
+	}
+
+	bool DebugExecutionManager::IsAtStepTarget(CodeTasklet* tasklet)
+	{
+		const auto stackId = tasklet->stack->stackID;
+
+		StepState stepState;
+		{
+			std::lock_guard<std::mutex> lock(m_stepMutex);
+			const auto entry = m_stepStates.find(stackId);
+			if (entry == m_stepStates.end())
+			{
+				return false;
+			}
+			stepState = entry->second;
+		}
+
+		if (!stepState.stackFrame)
+		{
+			return false;
+		}
+
+		std::vector<RE::BSScript::StackFrame*> currentFrames;
+		RuntimeState::GetStackFrames(stackId, currentFrames);
+
+		if (currentFrames.empty())
+		{
+			return false;
+		}
+
+		ptrdiff_t stepFrameIndex = -1;
+		const auto stepFrameIter = std::find(currentFrames.begin(), currentFrames.end(), stepState.stackFrame);
+
+		if (stepFrameIter != currentFrames.end())
+		{
+			stepFrameIndex = std::distance(currentFrames.begin(), stepFrameIter);
+		}
+
+		switch (stepState.stepType)
+		{
+		case StepType::STEP_IN:
+			return true;
+		case StepType::STEP_OUT:
+			// If the stack exists, but the original frame is gone, we know we're in a previous frame now.
+			return stepFrameIndex == -1;
+		case StepType::STEP_OVER:
+			return stepFrameIndex <= 0;
+		}
+
+		return false;
+	}
+
+	void DebugExecutionManager::QueueDecompilation(CodeTasklet* tasklet)
+	{
+		// this is the stack's own thread, so its frames can't change under us
+		for (auto frame = tasklet->topFrame; frame; frame = frame->previousFrame)
+		{
+			if (frame->owningFunction && !frame->owningFunction->GetIsNative() && frame->owningObjectType)
+			{
+				m_pexCache->QueueDecompilation(ScriptIdentityCache::GetSingleton().Get(frame->owningObjectType.get()));
+			}
+		}
+	}
+
+	bool DebugExecutionManager::Stop(const uint32_t stackId, const std::string& reason, const bool pauseRequested)
+	{
+		// Stopping one stack stops all of them, which also ends whatever step was in progress
+		bool othersParked;
+		{
+			std::lock_guard<std::mutex> lock(m_resumeMutex);
+			bool wasPaused = false;
+			const bool stoppedAll = m_pauseAll.compare_exchange_strong(wasPaused, true);
+			// Two stacks hitting breakpoints at once both get here; only the first reports. A stack let go by a
+			// single thread continue or step stops again on its own, and a pause request was already claimed
+			// through m_pauseEventPending.
+			if (!stoppedAll && !pauseRequested && !m_releasedStacks.Contains(stackId))
+			{
+				return false;
+			}
+
+			m_pauseEventPending = false;
+			m_releasedStacks.Clear();
+			othersParked = m_stacksParked;
+			m_stacksParked = true;
+			SetArmedFlag(kArmedPaused, true);
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_stepMutex);
+			m_stepStates.clear();
+			m_steppingStacks.Clear();
+			SetArmedFlag(kArmedStepping, false);
+		}
+		OnArmedStateChanged();
+		// references from an earlier pause would point at frames that have since moved on, unless they belong to
+		// stacks that stayed parked while this one ran on its own
+		if (othersParked)
+		{
+			m_runtimeState->InvalidateStackHandles(stackId);
+		}
+		else
+		{
+			m_runtimeState->InvalidateHandles();
+		}
+		if (m_snapshotOnPause)
+		{
+			m_runtimeState->Snapshot(stackId);
+		}
+
+		if (const auto session = GetSession()) {
+			session->send(dap::StoppedEvent{
+				.allThreadsStopped = true,
+				.reason = reason,
+				.threadId = stackId
+				});
+		}
+		Window::ReleaseFocus();
+		return true;
+	}
+
+	void DebugExecutionManager::HandleStackCleanup(const uint32_t stackId)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_resumeMutex);
+			m_releasedStacks.Remove(stackId);
+		}
+
+		bool wasSteppingAllThreads = false;
+		{
+			std::lock_guard<std::mutex> lock(m_stepMutex);
+			const auto entry = m_stepStates.find(stackId);
+			if (entry == m_stepStates.end())
+			{
+				return;
+			}
+
+			wasSteppingAllThreads = !entry->second.singleThread;
+			m_stepStates.erase(entry);
+			m_steppingStacks.Remove(stackId);
+			if (m_stepStates.empty())
+			{
+				SetArmedFlag(kArmedStepping, false);
+			}
+		}
+		OnArmedStateChanged();
 
+		// The stack we were stepping through returned for good; everything else is already running
+		if (wasSteppingAllThreads)
+		{
+			if (const auto session = GetSession()) {
+				session->send(dap::ContinuedEvent{
+				.allThreadsContinued = true,
+				.threadId = stackId
+					});
+			}
+		}
 	}
 
 	void DebugExecutionManager::Open(std::shared_ptr<dap::Session> ses)
 	{
-		m_closed = false;
+		std::lock_guard<std::mutex> lock(m_sessionMutex);
 		m_session = ses;
-		std::lock_guard<std::mutex> lock(m_instructionMutex);
+		m_closed = false;
 	}
 
 	void DebugExecutionManager::Close()
 	{
-		m_closed = true;
-		std::lock_guard<std::mutex> lock(m_instructionMutex);
-		m_session = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(m_resumeMutex);
+			m_resumeRequestedAt = std::chrono::steady_clock::now();
+			m_closed = true;
+			m_pauseAll = false;
+			m_pauseEventPending = false;
+			m_releasedStacks.Clear();
+			m_stacksParked = false;
+		}
+		SignalResume();
+		{
+			std::lock_guard<std::mutex> lock(m_stepMutex);
+			m_stepStates.clear();
+			m_steppingStacks.Clear();
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_sessionMutex);
+			m_session = nullptr;
+		}
+		m_runtimeState->InvalidateHandles();
+		m_armedState = kArmedNone;
+		OnArmedStateChanged();
 	}
 
-	bool DebugExecutionManager::Continue()
+	std::shared_ptr<dap::Session> DebugExecutionManager::GetSession()
 	{
-		m_state = DebuggerState::kRunning;
-		m_session->send(dap::ContinuedEvent());
+		std::lock_guard<std::mutex> lock(m_sessionMutex);
+		return m_session;
+	}
+
+	bool DebugExecutionManager::Continue(const uint32_t stackId, const bool singleThread)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_resumeMutex);
+			// stamped before the change below, which is what lets the waiters go
+			m_resumeRequestedAt = std::chrono::steady_clock::now();
+			if (singleThread)
+			{
+				m_releasedStacks.Insert(stackId);
+			}
+			else
+			{
+				m_pauseAll = false;
+				m_pauseEventPending = false;
+				m_releasedStacks.Clear();
+				m_stacksParked = false;
+			}
+			SetArmedFlag(kArmedPaused, m_pauseAll);
+		}
+		OnArmedStateChanged();
+		// the stacks that stay paused keep their references
+		if (singleThread)
+		{
+			m_runtimeState->InvalidateStackHandles(stackId);
+		}
+		else
+		{
+			m_runtimeState->InvalidateHandles();
+		}
+		SignalResume();
+
+		if (const auto session = GetSession()) {
+			session->send(dap::ContinuedEvent{
+				.allThreadsContinued = !singleThread,
+				.threadId = stackId
+				});
+		}
 
 		return true;
 	}
 
 	bool DebugExecutionManager::Pause()
 	{
-		if (m_state == DebuggerState::kPaused)
 		{
-			return false;
+			std::lock_guard<std::mutex> lock(m_resumeMutex);
+			if (m_pauseAll && m_releasedStacks.IsEmpty())
+			{
+				return false;
+			}
+
+			m_pauseAll = true;
+			m_pauseEventPending = true;
+			m_releasedStacks.Clear();
+			SetArmedFlag(kArmedPaused, true);
 		}
+		OnArmedStateChanged();
 
-		m_state = DebuggerState::kPaused;
 		return true;
 	}
 
-	bool DebugExecutionManager::Step(uint32_t stackId, const StepType stepType)
+	bool DebugExecutionManager::Step(const uint32_t stackId, const StepType stepType, const bool singleThread)
 	{
-		if (stackId < 0) {
+		if (!m_pausedStacks.Contains(stackId))
+		{
 			return false;
 		}
 
-		if (m_state != DebuggerState::kPaused)
+		const auto stack = RuntimeState::GetStack(stackId);
+		if (!stack || !stack->top)
 		{
 			return false;
 		}
 
-		const auto stack = RuntimeState::GetStack(stackId);
-		if (stack->stackID)
 		{
-			m_currentStepStackFrame = stack->top;
+			std::lock_guard<std::mutex> lock(m_stepMutex);
+			m_stepStates[stackId] = StepState{
+				.stackFrame = stack->top,
+				.stepType = stepType,
+				.singleThread = singleThread
+			};
+			m_steppingStacks.Insert(stackId);
+			SetArmedFlag(kArmedStepping, true);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_resumeMutex);
+			// stamped before the change below, which is what lets the waiters go
+			m_resumeRequestedAt = std::chrono::steady_clock::now();
+			if (singleThread)
+			{
+				m_releasedStacks.Insert(stackId);
+			}
+			else
+			{
+				m_pauseAll = false;
+				m_pauseEventPending = false;
+				m_releasedStacks.Clear();
+				m_stacksParked = false;
+			}
+			SetArmedFlag(kArmedPaused, m_pauseAll);
+		}
+		OnArmedStateChanged();
+		// the stacks that stay paused keep their references
+		if (singleThread)
+		{
+			m_runtimeState->InvalidateStackHandles(stackId);
 		}
 		else
 		{
-			return false;
+			m_runtimeState->InvalidateHandles();
+		}
+		SignalResume();
+
+		return true;
+	}
+
+	void DebugExecutionManager::SetBreakpointsArmed(const bool armed)
+	{
+		SetArmedFlag(kArmedBreakpoints, armed);
+		OnArmedStateChanged();
+	}
+
+	void DebugExecutionManager::SetArmedFlag(const ArmedFlags flag, const bool armed)
+	{
+		if (armed)
+		{
+			m_armedState.fetch_or(flag);
+		}
+		else
+		{
+			m_armedState.fetch_and(~static_cast<uint32_t>(flag));
 		}
+	}
 
-		m_state = DebuggerState::kStepping;
-		m_currentStepStackId = stackId;
-		m_currentStepType = stepType;
+	void DebugExecutionManager::OnArmedStateChanged()
+	{
+		// Only keep the instruction hook patched in while something needs it.
+		// Re-reading the word under the lock means the last caller always publishes the latest state.
+		std::lock_guard<std::mutex> lock(m_armedStateChangedMutex);
+		RuntimeEvents::SetInstructionHookArmed(m_armedState.load() != kArmedNone);
+	}
 
+	void DebugExecutionManager::SignalResume()
+	{
+		// callers have already changed what ShouldWait looks at under m_resumeMutex, so the notify can't be missed
+		m_resumeCondition.notify_all();
+	}
+
+	bool DebugExecutionManager::WaitWhilePaused(const uint32_t stackId)
+	{
+		std::chrono::steady_clock::time_point resumeRequestedAt;
+		{
+			std::unique_lock<std::mutex> lock(m_resumeMutex);
+			if (m_closed || !ShouldWait(stackId))
+			{
+				return false;
+			}
+
+			m_pausedStacks.Insert(stackId);
+			m_resumeCondition.wait(lock, [this, stackId]() {
+				return m_closed || !ShouldWait(stackId);
+			});
+			m_pausedStacks.Remove(stackId);
+			resumeRequestedAt = m_resumeRequestedAt;
+		}
+
+		RecordResumeLatency(std::chrono::steady_clock::now() - resumeRequestedAt);
 		return true;
 	}
+
+	void DebugExecutionManager::RecordResumeLatency(const std::chrono::nanoseconds latency)
+	{
+		std::lock_guard<std::mutex> lock(m_resumeLatencyMutex);
+		m_resumeLatencySamples[m_resumeLatencySampleIndex] = latency;
+		m_resumeLatencySampleIndex = (m_resumeLatencySampleIndex + 1) % kResumeLatencySampleCount;
+		m_resumeLatencySampleTotal++;
+	}
+
+	ResumeLatencyStats DebugExecutionManager::GetResumeLatencyStats() const
+	{
+		std::vector<std::chrono::nanoseconds> samples;
+		{
+			std::lock_guard<std::mutex> lock(m_resumeLatencyMutex);
+			const auto count = std::min(m_resumeLatencySampleTotal, kResumeLatencySampleCount);
+			samples.assign(m_resumeLatencySamples.begin(), m_resumeLatencySamples.begin() + count);
+		}
+
+		ResumeLatencyStats stats{ .sampleCount = static_cast<uint32_t>(samples.size()) };
+		if (samples.empty())
+		{
+			return stats;
+		}
+
+		std::sort(samples.begin(), samples.end());
+		const auto percentile = [&samples](const size_t percent) {
+			return samples[std::min(samples.size() - 1, samples.size() * percent / 100)];
+		};
+		stats.p50 = percentile(50);
+		stats.p90 = percentile(90);
+		stats.p99 = percentile(99);
+		stats.max = samples.back();
+
+		return stats;
+	}
 }
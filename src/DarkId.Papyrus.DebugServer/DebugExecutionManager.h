@@ -5,9 +5,15 @@
 
 #include "BreakpointManager.h"
 #include "RuntimeState.h"
+#include "StackIdSet.h"
 #include <dap/session.h>
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
+#include <unordered_map>
 
 namespace DarkId::Papyrus::DebugServer
 {
@@ -19,39 +25,103 @@ namespace DarkId::Papyrus::DebugServer
 
 	using namespace RE::BSScript::Internal;
 
+	// Time from a continue/step request to the paused tasklet running again
+	struct ResumeLatencyStats
+	{
+		uint32_t sampleCount;
+		std::chrono::nanoseconds p50;
+		std::chrono::nanoseconds p90;
+		std::chrono::nanoseconds p99;
+		std::chrono::nanoseconds max;
+	};
+
 	class DebugExecutionManager
 	{
-		enum class DebuggerState
+		// Bits of m_armedState; while none are set the instruction hook has nothing to do
+		enum ArmedFlags : uint32_t
+		{
+			kArmedNone = 0,
+			kArmedBreakpoints = 1 << 0,
+			kArmedStepping = 1 << 1,
+			kArmedPaused = 1 << 2
+		};
+
+		struct StepState
 		{
-			kRunning = 0,
-			kPaused,
-			kStepping
+			RE::BSScript::StackFrame* stackFrame;
+			StepType stepType;
+			bool singleThread;
 		};
 
-		std::mutex m_instructionMutex;
-		bool m_closed;
+		std::atomic<bool> m_closed;
+		std::atomic<uint32_t> m_armedState = kArmedNone;
+		std::mutex m_armedStateChangedMutex;
 
+		// Set while every stack is supposed to stop, except the ones in m_releasedStacks
+		std::atomic<bool> m_pauseAll = false;
+		// The first stack to park after a pause request reports the stop
+		std::atomic<bool> m_pauseEventPending = false;
+		StackIdSet m_pausedStacks;
+		// Stacks let go by a single thread continue or step while the rest stay paused
+		StackIdSet m_releasedStacks;
+		StackIdSet m_steppingStacks;
+		// Set from a stop until every stack resumes; a stack stopping in between leaves the others' handles alone
+		bool m_stacksParked = false;
+		std::atomic<bool> m_snapshotOnPause = false;
+
+		std::mutex m_stepMutex;
+		std::unordered_map<uint32_t, StepState> m_stepStates;
+
+		// Only taken by stacks that are parking or being resumed; changes to m_pauseAll and m_releasedStacks happen under it
+		std::mutex m_resumeMutex;
+		std::condition_variable m_resumeCondition;
+		// when the last resume was requested; guarded by m_resumeMutex
+		std::chrono::steady_clock::time_point m_resumeRequestedAt;
+
+		static constexpr size_t kResumeLatencySampleCount = 256;
+		mutable std::mutex m_resumeLatencyMutex;
+		std::array<std::chrono::nanoseconds, kResumeLatencySampleCount> m_resumeLatencySamples{};
+		size_t m_resumeLatencySampleIndex = 0;
+		size_t m_resumeLatencySampleTotal = 0;
+
+		std::mutex m_sessionMutex;
 		std::shared_ptr<dap::Session> m_session;
 		RuntimeState* m_runtimeState;
 		BreakpointManager* m_breakpointManager;
-
-		DebuggerState m_state = DebuggerState::kRunning;
-		uint32_t m_currentStepStackId = 0;
-		StepType m_currentStepType = StepType::STEP_IN;
-		RE::BSScript::StackFrame* m_currentStepStackFrame;
+		PexCache* m_pexCache;
 	public:
 		explicit DebugExecutionManager(RuntimeState* runtimeState,
-									   BreakpointManager* breakpointManager)
-			: m_runtimeState(runtimeState), m_breakpointManager(breakpointManager),
-			  m_currentStepStackFrame(nullptr), m_closed(true)
+									   BreakpointManager* breakpointManager,
+									   PexCache* pexCache)
+			: m_closed(true), m_runtimeState(runtimeState), m_breakpointManager(breakpointManager), m_pexCache(pexCache)
 		{
 		}
 
 		void Close();
 		void HandleInstruction(CodeTasklet* tasklet);
+		void HandleStackCleanup(uint32_t stackId);
 		void Open(std::shared_ptr<dap::Session> ses);
-		bool Continue();
+		bool Continue(uint32_t stackId, bool singleThread);
 		bool Pause();
-		bool Step(uint32_t stackId, StepType stepType);
+		bool Step(uint32_t stackId, StepType stepType, bool singleThread);
+		void SetBreakpointsArmed(bool armed);
+		void SetSnapshotOnPause(const bool snapshotOnPause) { m_snapshotOnPause = snapshotOnPause; }
+		bool IsArmed() const { return m_armedState.load(std::memory_order_relaxed) != kArmedNone; }
+		bool IsStackPaused(uint32_t stackId) const { return m_pausedStacks.Contains(stackId); }
+		ResumeLatencyStats GetResumeLatencyStats() const;
+	private:
+		std::shared_ptr<dap::Session> GetSession();
+		bool ShouldWait(uint32_t stackId) const;
+		bool IsAtStepTarget(CodeTasklet* tasklet);
+		// false if another stack already stopped everything, in which case this one should just park
+		bool Stop(uint32_t stackId, const std::string& reason, bool pauseRequested);
+		// Only updates the word; callers publish it with OnArmedStateChanged once they're out of their critical sections,
+		// since that can queue a code patch
+		void SetArmedFlag(ArmedFlags flag, bool armed);
+		void OnArmedStateChanged();
+		void SignalResume();
+		bool WaitWhilePaused(uint32_t stackId);
+		void QueueDecompilation(CodeTasklet* tasklet);
+		void RecordResumeLatency(std::chrono::nanoseconds latency);
 	};
 }
@@ -0,0 +1,371 @@
+#include "DebugInfoIndex.h"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <system_error>
+#include <thread>
+#include <Windows.h>
+
+#if SKYRIM
+#include <SKSE/Logger.h>
+#elif FALLOUT
+#include <F4SE/Logger.h>
+#endif
+
+namespace DarkId::Papyrus::DebugServer
+{
+	namespace
+	{
+		// File layout, all integers little-endian:
+		//   header: magic, version, entry count
+		//   entry:  u32 size of the rest of the entry, key, compilation time (u64), modification time (u64),
+		//           source file name, varint function count, then per function:
+		//           object, state, function name, u8 type, varint line count, zigzag varint line deltas
+		// Strings are a varint length followed by the bytes.
+		constexpr uint32_t kIndexMagic = 0x49494450; // "PDII"
+		constexpr uint32_t kIndexVersion = 1;
+		// scanners and indexers briefly hold files open, which makes replacing the index fail
+		constexpr int kReplaceAttempts = 5;
+		constexpr auto kReplaceRetryDelay = std::chrono::milliseconds(50);
+
+		class Writer
+		{
+		public:
+			explicit Writer(std::vector<char>& buffer) : m_buffer(buffer) {}
+
+			template <typename T>
+			void WriteFixed(const T value)
+			{
+				const auto bytes = reinterpret_cast<const char*>(&value);
+				m_buffer.insert(m_buffer.end(), bytes, bytes + sizeof(T));
+			}
+
+			void WriteVarint(uint64_t value)
+			{
+				while (value >= 0x80)
+				{
+					m_buffer.push_back(static_cast<char>((value & 0x7F) | 0x80));
+					value >>= 7;
+				}
+				m_buffer.push_back(static_cast<char>(value));
+			}
+
+			void WriteString(const std::string& value)
+			{
+				WriteVarint(value.size());
+				m_buffer.insert(m_buffer.end(), value.begin(), value.end());
+			}
+		private:
+			std::vector<char>& m_buffer;
+		};
+
+		// Every read is bounds checked; a truncated or corrupt file just stops reading
+		class Reader
+		{
+		public:
+			explicit Reader(const std::span<const char> data) : m_data(data) {}
+
+			bool Good() const { return m_good; }
+
+			template <typename T>
+			T ReadFixed()
+			{
+				T value{};
+				if (!Require(sizeof(T)))
+				{
+					return value;
+				}
+				std::memcpy(&value, m_data.data() + m_position, sizeof(T));
+				m_position += sizeof(T);
+				return value;
+			}
+
+			uint64_t ReadVarint()
+			{
+				uint64_t value = 0;
+				for (uint32_t shift = 0; shift < 64; shift += 7)
+				{
+					if (!Require(1))
+					{
+						return 0;
+					}
+					const auto byte = static_cast<uint8_t>(m_data[m_position++]);
+					value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+					if (!(byte & 0x80))
+					{
+						return value;
+					}
+				}
+				m_good = false;
+				return 0;
+			}
+
+			std::string ReadString()
+			{
+				const auto size = ReadVarint();
+				if (!Require(size))
+				{
+					return {};
+				}
+				std::string value(m_data.data() + m_position, size);
+				m_position += size;
+				return value;
+			}
+
+			std::span<const char> ReadSpan(const size_t size)
+			{
+				if (!Require(size))
+				{
+					return {};
+				}
+				const auto span = m_data.subspan(m_position, size);
+				m_position += size;
+				return span;
+			}
+		private:
+			std::span<const char> m_data;
+			size_t m_position = 0;
+			bool m_good = true;
+
+			bool Require(const uint64_t size)
+			{
+				if (!m_good || size > m_data.size() - m_position)
+				{
+					m_good = false;
+				}
+				return m_good;
+			}
+		};
+
+		// Appends an entry's body (everything after its size) to `buffer`
+		void EncodeEntry(const std::string& key, const ScriptDebugInfo& debugInfo, std::vector<char>& buffer)
+		{
+			Writer writer(buffer);
+			writer.WriteString(key);
+			writer.WriteFixed(static_cast<uint64_t>(debugInfo.compilationTime));
+			writer.WriteFixed(static_cast<uint64_t>(debugInfo.modificationTime));
+			writer.WriteString(debugInfo.sourceFileName);
+			writer.WriteVarint(debugInfo.functions.size());
+			for (const auto& function : debugInfo.functions)
+			{
+				writer.WriteString(function.objectName);
+				writer.WriteString(function.stateName);
+				writer.WriteString(function.functionName);
+				writer.WriteFixed(function.functionType);
+				writer.WriteVarint(function.lineNumbers.size());
+				// consecutive instructions are almost always on the same or a nearby line
+				int32_t previous = 0;
+				for (const auto line : function.lineNumbers)
+				{
+					const auto delta = static_cast<int32_t>(line) - previous;
+					writer.WriteVarint((static_cast<uint32_t>(delta) << 1) ^ static_cast<uint32_t>(delta >> 31));
+					previous = line;
+				}
+			}
+		}
+
+		// Reads just far enough into an entry to check it's the build we're looking for
+		bool ReadEntryHeader(Reader& reader, std::string& key, std::time_t& compilationTime)
+		{
+			key = reader.ReadString();
+			compilationTime = static_cast<std::time_t>(reader.ReadFixed<uint64_t>());
+			return reader.Good();
+		}
+
+		std::shared_ptr<ScriptDebugInfo> DecodeEntry(const std::span<const char> entry)
+		{
+			Reader reader(entry);
+			auto debugInfo = std::make_shared<ScriptDebugInfo>();
+			std::string key;
+			ReadEntryHeader(reader, key, debugInfo->compilationTime);
+			debugInfo->modificationTime = static_cast<std::time_t>(reader.ReadFixed<uint64_t>());
+			debugInfo->sourceFileName = reader.ReadString();
+
+			const auto functionCount = reader.ReadVarint();
+			for (uint64_t i = 0; i < functionCount && reader.Good(); i++)
+			{
+				auto& function = debugInfo->functions.emplace_back();
+				function.objectName = reader.ReadString();
+				function.stateName = reader.ReadString();
+				function.functionName = reader.ReadString();
+				function.functionType = reader.ReadFixed<uint8_t>();
+
+				const auto lineCount = reader.ReadVarint();
+				int32_t line = 0;
+				for (uint64_t j = 0; j < lineCount && reader.Good(); j++)
+				{
+					const auto zigzag = static_cast<uint32_t>(reader.ReadVarint());
+					line += static_cast<int32_t>(zigzag >> 1) ^ -static_cast<int32_t>(zigzag & 1);
+					function.lineNumbers.push_back(static_cast<uint16_t>(line));
+				}
+			}
+
+			return reader.Good() ? debugInfo : nullptr;
+		}
+	}
+
+	DebugInfoIndex::DebugInfoIndex(std::filesystem::path path) : m_path(std::move(path))
+	{
+	}
+
+	void DebugInfoIndex::Load()
+	{
+		std::unique_lock lock(m_mutex);
+		LoadLocked();
+	}
+
+	void DebugInfoIndex::LoadLocked()
+	{
+		m_stored.clear();
+		m_file.Close();
+		if (!m_file.Open(m_path))
+		{
+			return;
+		}
+
+		Reader reader(m_file.GetData());
+		const auto magic = reader.ReadFixed<uint32_t>();
+		const auto version = reader.ReadFixed<uint32_t>();
+		const auto count = reader.ReadFixed<uint32_t>();
+		if (!reader.Good() || magic != kIndexMagic || version != kIndexVersion)
+		{
+			logger::info("Ignoring debug info index {}, it was written by a different version"sv, m_path.string());
+			m_file.Close();
+			return;
+		}
+
+		m_stored.reserve(count);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			const auto size = reader.ReadFixed<uint32_t>();
+			const auto entry = reader.ReadSpan(size);
+			Reader entryReader(entry);
+			std::string key;
+			std::time_t compilationTime;
+			if (!reader.Good() || !ReadEntryHeader(entryReader, key, compilationTime))
+			{
+				logger::warn("Debug info index {} is truncated, keeping the first {} entries"sv, m_path.string(), i);
+				break;
+			}
+			m_stored.insert_or_assign(std::move(key), entry);
+		}
+	}
+
+	bool DebugInfoIndex::Save()
+	{
+		std::vector<char> buffer;
+		std::vector<std::pair<std::string, std::shared_ptr<const ScriptDebugInfo>>> written;
+		{
+			std::shared_lock lock(m_mutex);
+			if (m_added.empty())
+			{
+				return true;
+			}
+
+			Writer writer(buffer);
+			writer.WriteFixed(kIndexMagic);
+			writer.WriteFixed(kIndexVersion);
+			writer.WriteFixed(static_cast<uint32_t>(0));
+
+			uint32_t count = 0;
+			const auto writeEntry = [&](const auto& encode) {
+				const auto sizeOffset = buffer.size();
+				writer.WriteFixed(static_cast<uint32_t>(0));
+				encode();
+				const auto size = static_cast<uint32_t>(buffer.size() - sizeOffset - sizeof(uint32_t));
+				std::memcpy(buffer.data() + sizeOffset, &size, sizeof(size));
+				count++;
+			};
+
+			for (const auto& [key, entry] : m_stored)
+			{
+				if (!m_added.contains(key))
+				{
+					// unchanged entries are copied over without decoding them
+					writeEntry([&] { buffer.insert(buffer.end(), entry.begin(), entry.end()); });
+				}
+			}
+			for (const auto& [key, debugInfo] : m_added)
+			{
+				writeEntry([&] { EncodeEntry(key, *debugInfo, buffer); });
+				written.emplace_back(key, debugInfo);
+			}
+			std::memcpy(buffer.data() + sizeof(uint32_t) * 2, &count, sizeof(count));
+		}
+
+		auto tempPath = m_path;
+		tempPath += ".tmp";
+		{
+			std::ofstream output(tempPath, std::ios::binary | std::ios::trunc);
+			output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+			if (!output.good())
+			{
+				logger::error("Failed to write debug info index {}"sv, tempPath.string());
+				return false;
+			}
+		}
+
+		for (int attempt = 1;; attempt++)
+		{
+			{
+				std::unique_lock lock(m_mutex);
+				// the old file can't be replaced while it's mapped
+				m_file.Close();
+				const bool replaced = MoveFileExW(tempPath.c_str(), m_path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+				const auto error = GetLastError();
+				// maps whichever file is in place now, so a failed replace leaves the old entries where they were
+				LoadLocked();
+				if (replaced)
+				{
+					// anything Put while we were writing is still newer than what's on disk
+					for (const auto& [key, debugInfo] : written)
+					{
+						if (const auto added = m_added.find(key); added != m_added.end() && added->second == debugInfo)
+						{
+							m_added.erase(added);
+						}
+					}
+					return true;
+				}
+				if (attempt == kReplaceAttempts)
+				{
+					logger::error("Failed to replace debug info index {}: {}"sv, m_path.string(), std::system_category().message(static_cast<int>(error)));
+					return false;
+				}
+			}
+			std::this_thread::sleep_for(kReplaceRetryDelay);
+		}
+	}
+
+	std::shared_ptr<const ScriptDebugInfo> DebugInfoIndex::Find(const std::string& scriptKey, const std::time_t compilationTime) const
+	{
+		std::shared_lock lock(m_mutex);
+		if (const auto added = m_added.find(scriptKey); added != m_added.end())
+		{
+			return added->second->compilationTime == compilationTime ? added->second : nullptr;
+		}
+
+		const auto stored = m_stored.find(scriptKey);
+		if (stored == m_stored.end())
+		{
+			return nullptr;
+		}
+
+		Reader reader(stored->second);
+		std::string key;
+		std::time_t storedCompilationTime;
+		if (!ReadEntryHeader(reader, key, storedCompilationTime) || storedCompilationTime != compilationTime)
+		{
+			// stale; the caller rebuilds it from the PEX and puts it back
+			return nullptr;
+		}
+		return DecodeEntry(stored->second);
+	}
+
+	void DebugInfoIndex::Put(const std::string& scriptKey, std::shared_ptr<const ScriptDebugInfo> debugInfo)
+	{
+		std::unique_lock lock(m_mutex);
+		m_added.insert_or_assign(scriptKey, std::move(debugInfo));
+	}
+}
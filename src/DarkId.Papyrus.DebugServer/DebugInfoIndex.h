@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "MappedFile.h"
+
+namespace DarkId::Papyrus::DebugServer
+{
+	// The parts of a PEX debug info section the debugger needs, without the rest of the binary
+	struct FunctionDebugInfo
+	{
+		std::string objectName;
+		std::string stateName;
+		std::string functionName;
+		uint8_t functionType;
+		// source line of each instruction
+		std::vector<uint16_t> lineNumbers;
+	};
+
+	struct ScriptDebugInfo
+	{
+		// from the PEX header; identifies the exact build of the script
+		std::time_t compilationTime;
+		std::time_t modificationTime;
+		std::string sourceFileName;
+		std::vector<FunctionDebugInfo> functions;
+	};
+
+	// Debug info for every script we've seen, persisted between runs so that breakpoints and stack traces
+	// don't have to parse whole PEX files again. The file written by the last session is mapped read-only
+	// and entries are only decoded when asked for; new or rebuilt entries are kept in memory until Save.
+	class DebugInfoIndex
+	{
+	public:
+		explicit DebugInfoIndex(std::filesystem::path path);
+
+		// Maps the existing index file, if there is a valid one
+		void Load();
+		// Writes the index back out if anything was added since it was loaded
+		bool Save();
+
+		// nullptr if the script isn't indexed or was compiled at a different time than `compilationTime`
+		std::shared_ptr<const ScriptDebugInfo> Find(const std::string& scriptKey, std::time_t compilationTime) const;
+		void Put(const std::string& scriptKey, std::shared_ptr<const ScriptDebugInfo> debugInfo);
+	private:
+		std::filesystem::path m_path;
+		mutable std::shared_mutex m_mutex;
+		MappedFile m_file;
+		// encoded entries in the mapped file
+		std::unordered_map<std::string, std::span<const char>> m_stored;
+		// entries added this session, superseding stored ones with the same key
+		std::unordered_map<std::string, std::shared_ptr<const ScriptDebugInfo>> m_added;
+
+		// Load, with m_mutex already held
+		void LoadLocked();
+	};
+}
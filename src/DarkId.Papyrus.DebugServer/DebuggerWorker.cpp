@@ -0,0 +1,64 @@
+#include "DebuggerWorker.h"
+
+namespace DarkId::Papyrus::DebugServer
+{
+	DebuggerWorker::DebuggerWorker(const std::chrono::milliseconds tickInterval, Task onTick) :
+		m_tickInterval(tickInterval), m_onTick(std::move(onTick))
+	{
+		m_thread = std::thread(&DebuggerWorker::Run, this);
+	}
+
+	DebuggerWorker::~DebuggerWorker()
+	{
+		m_stopping = true;
+		m_pending.release();
+		if (m_thread.joinable())
+		{
+			m_thread.join();
+		}
+	}
+
+	void DebuggerWorker::Post(Task task)
+	{
+		m_tasks.Push(std::move(task));
+		m_pending.release();
+	}
+
+	void DebuggerWorker::Run()
+	{
+		Task task;
+		auto nextTick = std::chrono::steady_clock::now() + m_tickInterval;
+		while (true)
+		{
+			m_pending.try_acquire_until(nextTick);
+			if (m_stopping)
+			{
+				return;
+			}
+
+			// one release can stand for several tasks pushed before we woke up, so drain everything
+			while (m_tasks.TryPop(task))
+			{
+				try
+				{
+					task();
+				}
+				catch (const std::exception& e)
+				{
+					logger::error("Debugger worker task failed: {}"sv, e.what());
+				}
+				task = nullptr;
+			}
+
+			// a steady stream of tasks mustn't starve the tick
+			if (std::chrono::steady_clock::now() >= nextTick)
+			{
+				if (m_onTick)
+				{
+					m_onTick();
+				}
+				nextTick = std::chrono::steady_clock::now() + m_tickInterval;
+			}
+		}
+	}
+}
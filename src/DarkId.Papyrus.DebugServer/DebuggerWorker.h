@@ -0,0 +1,36 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <semaphore>
+#include <thread>
+
+#include "MpscQueue.h"
+
+namespace DarkId::Papyrus::DebugServer
+{
+	// A thread for debugger bookkeeping that game threads hand work to. Posting never blocks,
+	// so hooks running on the VM's threads can use it without stalling a frame.
+	class DebuggerWorker
+	{
+	public:
+		using Task = std::function<void()>;
+
+		// `onTick` runs on the worker about every `tickInterval`, for work that has to wait for the game to catch up
+		DebuggerWorker(std::chrono::milliseconds tickInterval, Task onTick);
+		~DebuggerWorker();
+
+		// Safe from any thread; tasks run in the order they were posted from a given thread
+		void Post(Task task);
+	private:
+		MpscQueue<Task> m_tasks;
+		std::counting_semaphore<> m_pending{ 0 };
+		std::atomic<bool> m_stopping = false;
+		std::chrono::milliseconds m_tickInterval;
+		Task m_onTick;
+		std::thread m_thread;
+
+		void Run();
+	};
+}
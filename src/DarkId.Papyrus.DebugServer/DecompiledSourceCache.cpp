@@ -0,0 +1,99 @@
+#include "DecompiledSourceCache.h"
+
+#include <algorithm>
+#include <lz4.h>
+
+namespace DarkId::Papyrus::DebugServer
+{
+	bool DecompiledSourceCache::Get(const int scriptReference, const std::time_t modificationTime, std::string& source)
+	{
+		std::vector<char> compressed;
+		size_t size;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			const auto entry = m_entries.find(scriptReference);
+			if (entry == m_entries.end() || entry->second.modificationTime != modificationTime)
+			{
+				m_misses++;
+				return false;
+			}
+
+			m_hits++;
+			entry->second.lastAccess = ++m_accessClock;
+			compressed = entry->second.compressed;
+			size = entry->second.size;
+		}
+
+		// decompress outside the lock; it's fast, but there's no reason to make other lookups wait on it
+		source.resize(size);
+		const auto decompressed = LZ4_decompress_safe(compressed.data(), source.data(), static_cast<int>(compressed.size()), static_cast<int>(size));
+		if (decompressed != static_cast<int>(size))
+		{
+			logger::error("Failed to decompress cached source for script reference {}"sv, scriptReference);
+			source.clear();
+			return false;
+		}
+		return true;
+	}
+
+	bool DecompiledSourceCache::Contains(const int scriptReference, const std::time_t modificationTime) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const auto entry = m_entries.find(scriptReference);
+		return entry != m_entries.end() && entry->second.modificationTime == modificationTime;
+	}
+
+	void DecompiledSourceCache::Put(const int scriptReference, const std::time_t modificationTime, const std::string& source)
+	{
+		std::vector<char> compressed(LZ4_compressBound(static_cast<int>(source.size())));
+		const auto compressedSize = LZ4_compress_default(source.data(), compressed.data(), static_cast<int>(source.size()), static_cast<int>(compressed.size()));
+		if (compressedSize <= 0)
+		{
+			return;
+		}
+		compressed.resize(compressedSize);
+		compressed.shrink_to_fit();
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto& entry = m_entries[scriptReference];
+		m_footprint -= entry.compressed.size();
+		m_footprint += compressed.size();
+		entry = Entry{
+			.modificationTime = modificationTime,
+			.compressed = std::move(compressed),
+			.size = source.size(),
+			.lastAccess = ++m_accessClock
+		};
+		EvictToBudget();
+	}
+
+	void DecompiledSourceCache::Clear()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_entries.clear();
+		m_footprint = 0;
+	}
+
+	DecompiledSourceCacheStats DecompiledSourceCache::GetStats() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return DecompiledSourceCacheStats{
+			.hits = m_hits,
+			.misses = m_misses,
+			.scriptCount = m_entries.size(),
+			.footprint = m_footprint
+		};
+	}
+
+	void DecompiledSourceCache::EvictToBudget()
+	{
+		while (m_footprint > m_memoryBudget && m_entries.size() > 1)
+		{
+			const auto oldest = std::min_element(m_entries.begin(), m_entries.end(), [](const auto& a, const auto& b) {
+				return a.second.lastAccess < b.second.lastAccess;
+			});
+			m_footprint -= oldest->second.compressed.size();
+			m_entries.erase(oldest);
+		}
+	}
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace DarkId::Papyrus::DebugServer
+{
+	struct DecompiledSourceCacheStats
+	{
+		uint64_t hits;
+		uint64_t misses;
+		size_t scriptCount;
+		// compressed bytes held
+		size_t footprint;
+	};
+
+	// Decompiled scripts, LZ4 compressed, keyed by script reference and the debug info modification time of the
+	// PEX they came from. Least recently used entries are dropped once the compressed size goes over budget.
+	class DecompiledSourceCache
+	{
+	public:
+		explicit DecompiledSourceCache(size_t memoryBudget) : m_memoryBudget(memoryBudget)
+		{
+		}
+
+		bool Get(int scriptReference, std::time_t modificationTime, std::string& source);
+		bool Contains(int scriptReference, std::time_t modificationTime) const;
+		void Put(int scriptReference, std::time_t modificationTime, const std::string& source);
+		void Clear();
+		DecompiledSourceCacheStats GetStats() const;
+	private:
+		struct Entry
+		{
+			std::time_t modificationTime;
+			std::vector<char> compressed;
+			size_t size;
+			uint64_t lastAccess;
+		};
+
+		mutable std::mutex m_mutex;
+		std::unordered_map<int, Entry> m_entries;
+		size_t m_memoryBudget;
+		size_t m_footprint = 0;
+		uint64_t m_accessClock = 0;
+		uint64_t m_hits = 0;
+		uint64_t m_misses = 0;
+
+		void EvictToBudget();
+	};
+}
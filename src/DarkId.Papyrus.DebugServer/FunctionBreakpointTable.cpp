@@ -0,0 +1,98 @@
+#include "FunctionBreakpointTable.h"
+
+namespace DarkId::Papyrus::DebugServer
+{
+	constexpr size_t kInitialSlotCount = 64;
+
+	bool FunctionBreakpointTable::Entry::HasBreakpointAt(const uint32_t instruction) const
+	{
+		const auto word = instruction / 64;
+		if (word >= instructionBits.size())
+		{
+			return false;
+		}
+
+		return (instructionBits[word] >> (instruction % 64)) & 1;
+	}
+
+	FunctionBreakpointTable::FunctionBreakpointTable() : m_slots(kInitialSlotCount)
+	{
+	}
+
+	size_t FunctionBreakpointTable::GetSlotIndex(const RE::BSScript::IFunction* function) const
+	{
+		// Fibonacci hashing of the pointer; the low bits are always zero due to alignment
+		const auto hash = (reinterpret_cast<uintptr_t>(function) >> 4) * 0x9E3779B97F4A7C15ull;
+		return static_cast<size_t>(hash >> 32) & (m_slots.size() - 1);
+	}
+
+	const FunctionBreakpointTable::Entry* FunctionBreakpointTable::Find(const RE::BSScript::IFunction* function) const
+	{
+		const auto mask = m_slots.size() - 1;
+		for (auto index = GetSlotIndex(function);; index = (index + 1) & mask)
+		{
+			const auto& slot = m_slots[index];
+			if (!slot.function)
+			{
+				return nullptr;
+			}
+			if (slot.function.get() == function)
+			{
+				return &slot;
+			}
+		}
+	}
+
+	const FunctionBreakpointTable::Entry* FunctionBreakpointTable::Insert(RE::BSScript::IFunction* function, std::vector<uint64_t> instructionBits)
+	{
+		// keep the load factor at or below one half so probe sequences stay short
+		if ((m_count + 1) * 2 > m_slots.size())
+		{
+			Grow();
+		}
+
+		const auto mask = m_slots.size() - 1;
+		for (auto index = GetSlotIndex(function);; index = (index + 1) & mask)
+		{
+			auto& slot = m_slots[index];
+			if (!slot.function)
+			{
+				slot.function = RE::BSTSmartPointer<RE::BSScript::IFunction>(function);
+				slot.instructionBits = std::move(instructionBits);
+				m_count++;
+				return &slot;
+			}
+			if (slot.function.get() == function)
+			{
+				slot.instructionBits = std::move(instructionBits);
+				return &slot;
+			}
+		}
+	}
+
+	void FunctionBreakpointTable::SetInstructionBit(std::vector<uint64_t>& instructionBits, const uint32_t instruction)
+	{
+		const auto word = instruction / 64;
+		if (word >= instructionBits.size())
+		{
+			instructionBits.resize(word + 1);
+		}
+
+		instructionBits[word] |= 1ull << (instruction % 64);
+	}
+
+	void FunctionBreakpointTable::Grow()
+	{
+		auto oldSlots = std::move(m_slots);
+		m_slots = std::vector<Entry>(oldSlots.size() * 2);
+		m_count = 0;
+
+		for (auto& slot : oldSlots)
+		{
+			if (slot.function)
+			{
+				Insert(slot.function.get(), std::move(slot.instructionBits));
+			}
+		}
+	}
+}
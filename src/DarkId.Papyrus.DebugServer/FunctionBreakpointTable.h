@@ -0,0 +1,38 @@
+#pragma once
+
+#include "GameInterfaces.h"
+
+#include <vector>
+
+namespace DarkId::Papyrus::DebugServer
+{
+	// Open-addressing table from a running ScriptFunction to the instructions it has breakpoints on.
+	// Functions without breakpoints get an empty entry, so the hook can bail out after a single probe.
+	// BreakpointManager copies a table to add to it, so one is never changed once threads can see it.
+	class FunctionBreakpointTable
+	{
+	public:
+		struct Entry
+		{
+			// Holding a reference keeps the key's address from being reused by a different function
+			RE::BSTSmartPointer<RE::BSScript::IFunction> function;
+			std::vector<uint64_t> instructionBits;
+
+			bool HasBreakpoints() const { return !instructionBits.empty(); }
+			bool HasBreakpointAt(uint32_t instruction) const;
+		};
+
+		FunctionBreakpointTable();
+
+		const Entry* Find(const RE::BSScript::IFunction* function) const;
+		const Entry* Insert(RE::BSScript::IFunction* function, std::vector<uint64_t> instructionBits);
+
+		static void SetInstructionBit(std::vector<uint64_t>& instructionBits, uint32_t instruction);
+	private:
+		std::vector<Entry> m_slots;
+		size_t m_count = 0;
+
+		size_t GetSlotIndex(const RE::BSScript::IFunction* function) const;
+		void Grow();
+	};
+}
@@ -1,109 +1,324 @@
 #pragma once
-#include "IdProvider.h"
 
-#include <unordered_map>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 namespace DarkId::Papyrus::DebugServer
 {
-	template<typename T>
+	// Two-way map between elements and ids, with ids that index straight into a slab of slots.
+	//
+	// An id is the slot's index plus the generation the slot was on when the id was handed out, so looking one up
+	// is an array access rather than a hash lookup, and an id whose element was removed stops resolving even once
+	// its slot has been reused. The element -> id direction is a small open-addressing table of ids.
+	//
+	// Get() doesn't take a lock: slots live in fixed-size chunks that never move, and a slot's element is only
+	// trusted if its generation is the same before and after reading it. Everything else is serialized.
+	template<typename T, typename Hash = std::hash<T>>
 	class IdMap
 	{
-		std::shared_ptr<IdProvider> m_idProvider;
-		std::unordered_map<uint32_t, T> m_idsToElements;
-		std::unordered_map<T, uint32_t> m_elementsToIds;
+		static constexpr uint32_t kIndexBits = 20;
+		static constexpr uint32_t kIndexMask = (1u << kIndexBits) - 1;
+		// keeps ids positive as 32-bit ints, which is what DAP references are. A slot has to be reused 2047 times
+		// before one of its old ids resolves again.
+		static constexpr uint32_t kGenerationMask = 0x7FF;
+		static constexpr uint32_t kChunkBits = 12;
+		static constexpr uint32_t kChunkSize = 1u << kChunkBits;
+		static constexpr uint32_t kMaxChunks = 1u << (kIndexBits - kChunkBits);
 
-		std::recursive_mutex m_elementsMutex;
-	public:
-		explicit IdMap(const std::shared_ptr<IdProvider> idProvider) :
-			m_idProvider(idProvider)
+		// reverse table markers; a real id always has a non-zero generation, so it's never below 1 << kIndexBits
+		static constexpr uint32_t kEmpty = 0;
+		static constexpr uint32_t kTombstone = 1;
+
+		struct Slot
+		{
+			// 0 while free, otherwise the generation of the id that owns it
+			std::atomic<uint32_t> generation = 0;
+			std::atomic<std::shared_ptr<const T>> element;
+			// only touched with m_writeMutex held; `value` is what `element` owns, so lookups by element don't have
+			// to load the atomic shared_ptr
+			const T* value = nullptr;
+			uint32_t lastGeneration = 0;
+			size_t hash = 0;
+		};
+
+		std::array<std::atomic<Slot*>, kMaxChunks> m_chunks{};
+		std::vector<std::unique_ptr<Slot[]>> m_ownedChunks;
+		uint32_t m_slotCount = 0;
+		std::vector<uint32_t> m_freeSlots;
+
+		std::vector<uint32_t> m_reverse;
+		// live ids plus tombstones; probing only stops at an empty entry, so both count towards the load
+		size_t m_reverseUsed = 0;
+		size_t m_reverseLive = 0;
+
+		std::mutex m_writeMutex;
+
+		static uint32_t MakeId(const uint32_t index, const uint32_t generation)
 		{
+			return (generation << kIndexBits) | index;
 		}
 
-		~IdMap()
+		Slot* GetSlot(const uint32_t index) const
 		{
-			Clear();
+			const auto chunk = m_chunks[index >> kChunkBits].load(std::memory_order_acquire);
+			return chunk ? &chunk[index & (kChunkSize - 1)] : nullptr;
 		}
 
-		bool Get(uint32_t id, T& value)
+		Slot* GetLiveSlot(const uint32_t id) const
 		{
-			std::lock_guard lock(m_elementsMutex);
+			const auto slot = GetSlot(id & kIndexMask);
+			if (!slot || id >> kIndexBits == 0 || slot->generation.load(std::memory_order_acquire) != id >> kIndexBits)
+			{
+				return nullptr;
+			}
+			return slot;
+		}
 
-			auto pair = m_idsToElements.find(id);
-			if (pair != m_idsToElements.end())
+		bool AllocateSlot(uint32_t& index)
+		{
+			if (!m_freeSlots.empty())
 			{
-				value = pair->second;
+				index = m_freeSlots.back();
+				m_freeSlots.pop_back();
 				return true;
 			}
 
-			return false;
+			if (m_slotCount > kIndexMask)
+			{
+				return false;
+			}
+
+			index = m_slotCount++;
+			const auto chunkIndex = index >> kChunkBits;
+			if (!m_chunks[chunkIndex].load(std::memory_order_relaxed))
+			{
+				m_ownedChunks.push_back(std::make_unique<Slot[]>(kChunkSize));
+				m_chunks[chunkIndex].store(m_ownedChunks.back().get(), std::memory_order_release);
+			}
+			return true;
 		}
 
-		bool GetId(T element, uint32_t& id)
+		// Index into m_reverse holding the element's id, or of the first empty entry on its probe sequence
+		size_t FindReverse(const T& element, const size_t hash, bool& found) const
 		{
-			std::lock_guard lock(m_elementsMutex);
-
-			auto pair = m_elementsToIds.find(element);
-			if (pair != m_elementsToIds.end())
+			found = false;
+			const auto mask = m_reverse.size() - 1;
+			auto insertAt = SIZE_MAX;
+			for (auto i = hash & mask;; i = (i + 1) & mask)
 			{
-				id = pair->second;
-				return true;
+				const auto id = m_reverse[i];
+				if (id == kEmpty)
+				{
+					return insertAt != SIZE_MAX ? insertAt : i;
+				}
+				if (id == kTombstone)
+				{
+					if (insertAt == SIZE_MAX)
+					{
+						insertAt = i;
+					}
+					continue;
+				}
+
+				const auto slot = GetSlot(id & kIndexMask);
+				if (slot->hash == hash && *slot->value == element)
+				{
+					found = true;
+					return i;
+				}
 			}
+		}
+
+		void GrowReverse()
+		{
+			// when most of the load is tombstones, rebuilding at the same size is enough
+			const auto size = m_reverseLive * 2 >= m_reverseUsed ? m_reverse.size() * 2 : m_reverse.size();
+			std::vector<uint32_t> previous(std::max<size_t>(size, 64), kEmpty);
+			previous.swap(m_reverse);
+			m_reverseUsed = 0;
+
+			const auto mask = m_reverse.size() - 1;
+			for (const auto id : previous)
+			{
+				if (id == kEmpty || id == kTombstone)
+				{
+					continue;
+				}
 
-			return false;
+				auto i = GetSlot(id & kIndexMask)->hash & mask;
+				while (m_reverse[i] != kEmpty)
+				{
+					i = (i + 1) & mask;
+				}
+				m_reverse[i] = id;
+				m_reverseUsed++;
+			}
+			m_reverseLive = m_reverseUsed;
 		}
 
-		bool AddOrGetExisting(T element, uint32_t& id)
+		void RemoveLocked(const uint32_t id, Slot* slot)
 		{
-			std::lock_guard lock(m_elementsMutex);
+			bool found;
+			const auto reverseIndex = FindReverse(*slot->value, slot->hash, found);
+			if (found)
+			{
+				// the used count stays as is until the next rebuild
+				m_reverse[reverseIndex] = kTombstone;
+				m_reverseLive--;
+			}
 
-			if (GetId(element, id))
+			// retire the generation first, so a concurrent Get can't pair the old id with whatever comes next
+			slot->generation.store(0, std::memory_order_release);
+			slot->element.store(nullptr, std::memory_order_release);
+			slot->value = nullptr;
+			m_freeSlots.push_back(id & kIndexMask);
+		}
+	public:
+		IdMap() = default;
+		IdMap(const IdMap&) = delete;
+		IdMap& operator=(const IdMap&) = delete;
+
+		bool Get(const uint32_t id, T& value) const
+		{
+			const auto slot = GetLiveSlot(id);
+			if (!slot)
 			{
 				return false;
 			}
 
-			id = m_idProvider->GetNext();
-			m_idsToElements.emplace(id, element);
-			m_elementsToIds.emplace(element, id);
+			const auto element = slot->element.load(std::memory_order_acquire);
+			if (!element || slot->generation.load(std::memory_order_acquire) != id >> kIndexBits)
+			{
+				return false;
+			}
 
+			value = *element;
 			return true;
 		}
 
-		bool Remove(uint32_t id)
+		bool GetId(const T& element, uint32_t& id)
+		{
+			std::lock_guard lock(m_writeMutex);
+			if (m_reverse.empty())
+			{
+				return false;
+			}
+
+			bool found;
+			const auto reverseIndex = FindReverse(element, Hash{}(element), found);
+			if (found)
+			{
+				id = m_reverse[reverseIndex];
+			}
+			return found;
+		}
+
+		// Returns true if the element was added, false if it was already there (or the map is full, with id 0)
+		bool AddOrGetExisting(const T& element, uint32_t& id)
 		{
-			std::lock_guard lock(m_elementsMutex);
+			std::lock_guard lock(m_writeMutex);
 
-			auto pair = m_idsToElements.find(id);
-			if (pair != m_idsToElements.end())
+			if ((m_reverseUsed + 1) * 10 > m_reverse.size() * 7)
 			{
-				m_idsToElements.erase(id);
-				m_elementsToIds.erase(pair->second);
-				return true;
+				GrowReverse();
+			}
+
+			const auto hash = Hash{}(element);
+			bool found;
+			const auto reverseIndex = FindReverse(element, hash, found);
+			if (found)
+			{
+				id = m_reverse[reverseIndex];
+				return false;
+			}
+
+			uint32_t index;
+			if (!AllocateSlot(index))
+			{
+				id = 0;
+				return false;
 			}
 
-			return false;
+			const auto slot = GetSlot(index);
+			auto generation = (slot->lastGeneration + 1) & kGenerationMask;
+			if (generation == 0)
+			{
+				generation = 1;
+			}
+			slot->lastGeneration = generation;
+			slot->hash = hash;
+			auto value = std::make_shared<const T>(element);
+			slot->value = value.get();
+			slot->element.store(std::move(value), std::memory_order_release);
+			slot->generation.store(generation, std::memory_order_release);
+
+			id = MakeId(index, generation);
+			if (m_reverse[reverseIndex] == kEmpty)
+			{
+				m_reverseUsed++;
+			}
+			m_reverse[reverseIndex] = id;
+			m_reverseLive++;
+			return true;
 		}
 
-		bool Remove(T element)
+		bool Remove(const uint32_t id)
 		{
-			std::lock_guard lock(m_elementsMutex);
+			std::lock_guard lock(m_writeMutex);
+			const auto slot = GetLiveSlot(id);
+			if (!slot)
+			{
+				return false;
+			}
+
+			RemoveLocked(id, slot);
+			return true;
+		}
 
-			uint32_t id;
-			if (GetId(element), id)
+		bool Remove(const T& element)
+		{
+			std::lock_guard lock(m_writeMutex);
+			if (m_reverse.empty())
 			{
-				return Remove(id);
+				return false;
 			}
 
-			return false;
+			bool found;
+			const auto reverseIndex = FindReverse(element, Hash{}(element), found);
+			if (!found)
+			{
+				return false;
+			}
+
+			const auto id = m_reverse[reverseIndex];
+			RemoveLocked(id, GetSlot(id & kIndexMask));
+			return true;
 		}
 
+		// Every id handed out so far stops resolving; slots and chunks are kept for reuse
 		void Clear()
 		{
-			std::lock_guard lock(m_elementsMutex);
+			std::lock_guard lock(m_writeMutex);
 
-			m_idsToElements.clear();
-			m_elementsToIds.clear();
+			m_freeSlots.clear();
+			for (uint32_t index = m_slotCount; index > 0; index--)
+			{
+				const auto slot = GetSlot(index - 1);
+				slot->generation.store(0, std::memory_order_release);
+				slot->element.store(nullptr, std::memory_order_release);
+				slot->value = nullptr;
+				m_freeSlots.push_back(index - 1);
+			}
+
+			std::fill(m_reverse.begin(), m_reverse.end(), kEmpty);
+			m_reverseUsed = 0;
+			m_reverseLive = 0;
 		}
 	};
-
 }
-
@@ -4,7 +4,27 @@ namespace DarkId::Papyrus::DebugServer
 {
 	uint32_t IdProvider::GetNext()
 	{
-		std::lock_guard<std::mutex> lock(m_idMutex);
-		return m_currentId++;
+		return m_next.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void IdProvider::NextGeneration()
+	{
+		auto current = m_next.load(std::memory_order_relaxed);
+		uint32_t next;
+		do
+		{
+			// generation 0 is never used, so an untagged id can't pass for a current one
+			auto generation = (GetGeneration(current) + 1) & kGenerationMask;
+			if (generation == 0)
+			{
+				generation = 1;
+			}
+			next = (generation << kIndexBits) | kFirstIndex;
+		} while (!m_next.compare_exchange_weak(current, next, std::memory_order_relaxed));
+	}
+
+	bool IdProvider::IsCurrent(const uint32_t id) const
+	{
+		return GetGeneration(id) == GetGeneration(m_next.load(std::memory_order_relaxed));
 	}
 }
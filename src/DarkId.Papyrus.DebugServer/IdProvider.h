@@ -1,13 +1,31 @@
 ﻿#pragma once
-#include <mutex>
+#include <atomic>
+#include <cstdint>
 
 namespace DarkId::Papyrus::DebugServer
 {
+	// Hands out ids tagged with the generation they were created in. Ids go back to the client as DAP
+	// references, so they have to stay positive 32-bit ints: the top bit is unused, the next 11 hold the
+	// generation and the rest are a counter that starts over with every generation.
+	//
+	// Generations wrap after 2047 pauses, so an id kept around for that long could pass for a current one again;
+	// it then finds a fresh handle table and resolves to nothing, or at worst to a node from the current pause.
+	// A pause that hands out more than a million ids runs into the next generation, which only makes its
+	// earlier ids look stale.
 	class IdProvider
 	{
-		uint32_t m_currentId = 1000;
-		std::mutex m_idMutex;
+		static constexpr uint32_t kIndexBits = 20;
+		static constexpr uint32_t kGenerationMask = 0x7FF;
+		static constexpr uint32_t kFirstIndex = 1000;
+
+		std::atomic<uint32_t> m_next = (1 << kIndexBits) | kFirstIndex;
 	public:
 		uint32_t GetNext();
+
+		// Starts a new generation; ids from earlier ones are no longer current
+		void NextGeneration();
+		bool IsCurrent(uint32_t id) const;
+
+		static uint32_t GetGeneration(const uint32_t id) { return (id >> kIndexBits) & kGenerationMask; }
 	};
 }
\ No newline at end of file
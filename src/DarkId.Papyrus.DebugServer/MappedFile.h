@@ -0,0 +1,27 @@
+#pragma once
+
+#include <filesystem>
+#include <span>
+
+namespace DarkId::Papyrus::DebugServer
+{
+	// Read-only view of a whole file, mapped into memory for as long as this object lives
+	class MappedFile
+	{
+	public:
+		MappedFile() = default;
+		~MappedFile();
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		bool Open(const std::filesystem::path& path);
+		void Close();
+		bool IsOpen() const { return m_view != nullptr; }
+		std::span<const char> GetData() const { return { static_cast<const char*>(m_view), m_size }; }
+	private:
+		void* m_file = nullptr;
+		void* m_mapping = nullptr;
+		const void* m_view = nullptr;
+		size_t m_size = 0;
+	};
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+namespace DarkId::Papyrus::DebugServer
+{
+	// Unbounded multi-producer, single-consumer queue (Vyukov's node-based design).
+	// Push is a single atomic exchange, so producers never block or spin; only one thread may Pop.
+	template <typename T>
+	class MpscQueue
+	{
+	public:
+		MpscQueue() : m_head(new Node()), m_tail(m_head.load(std::memory_order_relaxed))
+		{
+		}
+
+		~MpscQueue()
+		{
+			T value;
+			while (TryPop(value))
+			{
+			}
+			delete m_tail;
+		}
+
+		MpscQueue(const MpscQueue&) = delete;
+		MpscQueue& operator=(const MpscQueue&) = delete;
+
+		void Push(T value)
+		{
+			const auto node = new Node();
+			node->value = std::move(value);
+			const auto previous = m_head.exchange(node, std::memory_order_acq_rel);
+			// until this store the consumer sees the queue end at `previous`; it just picks `node` up next time
+			previous->next.store(node, std::memory_order_release);
+		}
+
+		bool TryPop(T& value)
+		{
+			const auto tail = m_tail;
+			const auto next = tail->next.load(std::memory_order_acquire);
+			if (!next)
+			{
+				return false;
+			}
+
+			// `next` becomes the new empty stub once its value is taken
+			value = std::move(next->value);
+			m_tail = next;
+			delete tail;
+			return true;
+		}
+	private:
+		struct Node
+		{
+			std::atomic<Node*> next = nullptr;
+			T value{};
+		};
+
+		std::atomic<Node*> m_head;
+		// only touched by the consumer
+		Node* m_tail;
+	};
+}
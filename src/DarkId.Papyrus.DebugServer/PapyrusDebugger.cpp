@@ -1,7 +1,10 @@
 #include "PapyrusDebugger.h"
 
+#include <algorithm>
 #include <functional>
 #include <string>
+#include <thread>
+#include <unordered_set>
 #include <dap/protocol.h>
 #include <dap/session.h>
 
@@ -30,14 +33,20 @@ namespace DarkId::Papyrus::DebugServer
 {
 	PapyrusDebugger::PapyrusDebugger()
 	{
+		m_worker = std::make_unique<DebuggerWorker>(std::chrono::milliseconds(50), [this]() { WorkerTick(); });
 		m_pexCache = std::make_shared<PexCache>();
+		if (const auto logDirectory = logger::log_directory())
+		{
+			m_pexCache->OpenDebugInfoIndex(*logDirectory / "DarkId.Papyrus.DebugServer.debuginfo");
+		}
+		m_pexPrefetcher = std::make_shared<PexPrefetcher>(m_pexCache.get());
 
 		m_breakpointManager = std::make_shared<BreakpointManager>(m_pexCache.get());
 
 		m_idProvider = std::make_shared<IdProvider>();
 		m_runtimeState = std::make_shared<RuntimeState>(m_idProvider);
 
-		m_executionManager = std::make_shared<DebugExecutionManager>(m_runtimeState.get(), m_breakpointManager.get());
+		m_executionManager = std::make_shared<DebugExecutionManager>(m_runtimeState.get(), m_breakpointManager.get(), m_pexCache.get());
 
 	}
 
@@ -65,9 +74,12 @@ namespace DarkId::Papyrus::DebugServer
 		RegisterSessionHandlers();
 	}
 	void PapyrusDebugger::EndSession() {
+		// close first, so tasks already posted to the worker stop before the session goes away
+		m_closed = true;
+		m_pexPrefetcher->Cancel();
+		CancelLoadedSources();
 		m_executionManager->Close();
 		m_session = nullptr;
-		m_closed = true;
 
 		RuntimeEvents::UnsubscribeFromLog(m_logEventHandle);
 		// RuntimeEvents::UnsubscribeFromInitScript(m_initScriptEventHandle);
@@ -80,86 +92,102 @@ namespace DarkId::Papyrus::DebugServer
 		// clear session data
 		m_modDirectory = "";
 		m_projectPath = "";
-		m_projectSources.clear();
+		m_projectSources.store(std::make_shared<const ProjectSources>());
+		m_pexCache->SetLooseScriptDirectories({});
+		m_pexCache->SaveDebugInfoIndex();
+		ScriptIdentityCache::GetSingleton().ClearLookups();
 		m_breakpointManager->ClearBreakpoints();
-		
+		m_executionManager->SetBreakpointsArmed(false);
 	}
 
 	void PapyrusDebugger::RegisterSessionHandlers() {
+		const auto session = m_session.load();
 		// The Initialize request is the first message sent from the client and
 		// the response reports debugger capabilities.
 		// https://microsoft.github.io/debug-adapter-protocol/specification#Requests_Initialize
-		m_session->registerHandler([](const dap::InitializeRequest& request) {
+		session->registerHandler([this](const dap::InitializeRequest& request) {
+			m_clientSupportsProgress = request.supportsProgressReporting.value(false);
 			dap::InitializeResponse response;
 			response.supportsConfigurationDoneRequest = true;
 			response.supportsLoadedSourcesRequest = true;
+			response.supportsSingleThreadExecutionRequests = true;
+			response.supportsBreakpointLocationsRequest = true;
 			return response;
 		});
-		m_session->onError([this](const char* msg) {
+		session->onError([this](const char* msg) {
 			logger::error("{}", msg);
 		});
-		m_session->registerSentHandler(
+		session->registerSentHandler(
 			[this](const dap::ResponseOrError<dap::InitializeResponse>&) {
 				SendEvent(dap::InitializedEvent());
 		});
 
 		// Client is done configuring.
-		m_session->registerHandler([this](const dap::ConfigurationDoneRequest&) {
+		session->registerHandler([this](const dap::ConfigurationDoneRequest&) {
 			return dap::ConfigurationDoneResponse{};
 		});
 
 		// The Disconnect request is made by the client before it disconnects
 		// from the server.
 		// https://microsoft.github.io/debug-adapter-protocol/specification#Requests_Disconnect
-		m_session->registerHandler([this](const dap::DisconnectRequest&) {
+		session->registerHandler([this](const dap::DisconnectRequest&) {
 			// Client wants to disconnect.
 			return dap::DisconnectResponse{};
 		});
-		m_session->registerHandler([this](const dap::PDSLaunchRequest& request) {
+		session->registerHandler([this](const dap::PDSLaunchRequest& request) {
 			return Launch(request);
 		});
-		m_session->registerHandler([this](const dap::PDSAttachRequest& request) {
+		session->registerHandler([this](const dap::PDSAttachRequest& request) {
 			return Attach(request);
 		});
-		m_session->registerHandler([this](const dap::PauseRequest& request) {
+		session->registerHandler([this](const dap::PauseRequest& request) {
 			return Pause(request);
 		});
-		m_session->registerHandler([this](const dap::ContinueRequest& request) {
+		session->registerHandler([this](const dap::ContinueRequest& request) {
 			return Continue(request);
 		});
-		m_session->registerHandler([this](const dap::ThreadsRequest& request) {
+		session->registerHandler([this](const dap::ThreadsRequest& request) {
 			return GetThreads(request);
 		});
-		m_session->registerHandler([this](const dap::SetBreakpointsRequest& request) {
+		session->registerHandler([this](const dap::SetBreakpointsRequest& request) {
 			return SetBreakpoints(request);
 		});
-		m_session->registerHandler([this](const dap::SetFunctionBreakpointsRequest& request) {
+		session->registerHandler([this](const dap::BreakpointLocationsRequest& request) {
+			return GetBreakpointLocations(request);
+		});
+		session->registerHandler([this](const dap::SetFunctionBreakpointsRequest& request) {
 			return SetFunctionBreakpoints(request);
 		});
-		m_session->registerHandler([this](const dap::StackTraceRequest& request) {
+		session->registerHandler([this](const dap::StackTraceRequest& request) {
 			return GetStackTrace(request);
 		});
-		m_session->registerHandler([this](const dap::StepInRequest& request) {
+		session->registerHandler([this](const dap::StepInRequest& request) {
 			return StepIn(request);
 		});
-		m_session->registerHandler([this](const dap::StepOutRequest& request) {
+		session->registerHandler([this](const dap::StepOutRequest& request) {
 			return StepOut(request);
 		});
-		m_session->registerHandler([this](const dap::NextRequest& request) {
+		session->registerHandler([this](const dap::NextRequest& request) {
 			return Next(request);
 		});
-		m_session->registerHandler([this](const dap::ScopesRequest& request) {
+		session->registerHandler([this](const dap::ScopesRequest& request) {
 			return GetScopes(request);
 		});
-		m_session->registerHandler([this](const dap::VariablesRequest& request) {
+		session->registerHandler([this](const dap::VariablesRequest& request) {
 			return GetVariables(request);
 		});
-		m_session->registerHandler([this](const dap::SourceRequest& request) {
+		session->registerHandler([this](const dap::SourceRequest& request) {
 			return GetSource(request);
 		});
-		m_session->registerHandler([this](const dap::LoadedSourcesRequest& request) {
+		session->registerHandler([this](const dap::LoadedSourcesRequest& request) {
 			return GetLoadedSources(request);
 		});
+		session->registerHandler([this](const dap::PDSDebuggerStatsRequest& request) {
+			return GetDebuggerStats(request);
+		});
+		session->registerHandler([this](const dap::PDSDecompiledSourceRequest& request) {
+			return GetDecompiledSource(request);
+		});
 	}
 
 	dap::Error PapyrusDebugger::Error(const std::string &msg)
@@ -170,8 +198,8 @@ namespace DarkId::Papyrus::DebugServer
 
 	template <typename T, typename>
 	void PapyrusDebugger::SendEvent(const T& event) const{
-		if (m_session)
-			m_session->send(event);
+		if (const auto session = m_session.load())
+			session->send(event);
 	}
 
 	std::string LogSeverityEnumStr(RE::BSScript::ErrorLogger::Severity severity) {
@@ -221,46 +249,94 @@ namespace DarkId::Papyrus::DebugServer
 
 	void PapyrusDebugger::StackCreated(RE::BSTSmartPointer<RE::BSScript::Stack>& stack)
 	{
+		// this runs on a VM thread; everything else happens on the worker
 		const auto stackId = stack->stackID;
-		
-		XSE::GetTaskInterface()->AddTask([this, stackId]()
-		{
-			if (m_closed || !m_runtimeState)
-			{
-				return;
-			}
-
-			const auto stack = m_runtimeState->GetStack(stackId);
-			if (!stack)
+		const auto createdAt = ThreadEventCoalescer::Clock::now();
+		m_worker->Post([this, stackId, createdAt]() {
+			if (m_closed)
 			{
 				return;
 			}
 
-			SendEvent(dap::ThreadEvent{
-				.reason = "started",
-				.threadId = stackId
-				});
-			
-			if (stack->top && stack->top->owningFunction)
+			m_threadEvents.Started(stackId, createdAt);
+			if (!CheckStackSourceLoaded(stackId))
 			{
-				// TODO: Not in use, just for debugging reference.
-				auto srcFileName = stack->top->owningFunction->GetSourceFilename().c_str();
-				const auto scriptName = NormalizeScriptName(stack->top->owningObjectType->GetName());
-				CheckSourceLoaded(scriptName);
+				m_pendingSourceChecks.push_back(PendingSourceCheck{ .stackId = stackId });
 			}
 		});
 	}
 	
 	void PapyrusDebugger::StackCleanedUp(uint32_t stackId)
 	{
-		XSE::GetTaskInterface()->AddTask([this, stackId]()
-		{
+		m_executionManager->HandleStackCleanup(stackId);
+
+		const auto cleanedUpAt = ThreadEventCoalescer::Clock::now();
+		m_worker->Post([this, stackId, cleanedUpAt]() {
 			if (m_closed) return;
 
-			SendEvent(dap::ThreadEvent{
-				.reason = "exited",
-				.threadId = stackId
-			});
+			m_threadEvents.Exited(stackId, cleanedUpAt);
+		});
+	}
+
+	bool PapyrusDebugger::CheckStackSourceLoaded(const uint32_t stackId)
+	{
+		const auto stack = RuntimeState::GetStack(stackId);
+		if (!stack)
+		{
+			// already gone, nothing left to check
+			return true;
+		}
+
+		const ScriptIdentity* identity = nullptr;
+		{
+			const auto vm = RE::BSScript::Internal::VirtualMachine::GetSingleton();
+			RE::BSSpinLockGuard lock(vm->runningStacksLock);
+			if (!stack->top || !stack->top->owningFunction)
+			{
+				return false;
+			}
+			identity = &ScriptIdentityCache::GetSingleton().Get(stack->top->owningObjectType.get());
+		}
+
+		CheckSourceLoaded(*identity);
+		return true;
+	}
+
+	void PapyrusDebugger::WorkerTick()
+	{
+		if (m_closed)
+		{
+			m_pendingSourceChecks.clear();
+			m_threadEvents.Reset();
+			return;
+		}
+
+		const auto now = ThreadEventCoalescer::Clock::now();
+		std::vector<dap::ThreadEvent> threadEvents;
+		m_threadEvents.Flush(now, threadEvents);
+		for (const auto& threadEvent : threadEvents)
+		{
+			SendEvent(threadEvent);
+		}
+		if (m_threadEvents.IsSummaryOnly() && now - m_lastThreadSummary >= std::chrono::seconds(1))
+		{
+			ThreadEventSummary summary;
+			if (m_threadEvents.TakeSummary(summary))
+			{
+				SendEvent(dap::PDSThreadSummaryEvent{
+					.started = static_cast<dap::integer>(summary.started),
+					.exited = static_cast<dap::integer>(summary.exited),
+					.coalesced = static_cast<dap::integer>(summary.coalesced),
+					.running = static_cast<dap::integer>(summary.running)
+				});
+			}
+			m_lastThreadSummary = now;
+		}
+
+		// stacks are created before their first frame is pushed; look again once the VM has had a chance to
+		constexpr uint32_t kMaxSourceCheckAttempts = 10;
+		std::erase_if(m_pendingSourceChecks, [this](PendingSourceCheck& pending) {
+			return CheckStackSourceLoaded(pending.stackId) || ++pending.attempts >= kMaxSourceCheckAttempts;
 		});
 	}
 
@@ -269,18 +345,18 @@ namespace DarkId::Papyrus::DebugServer
 		m_executionManager->HandleInstruction(tasklet);
 	}
 
-	void PapyrusDebugger::CheckSourceLoaded(const std::string &scriptName) const{
-		if (!m_pexCache->HasScript(scriptName))
+	void PapyrusDebugger::CheckSourceLoaded(const ScriptIdentity& identity) const{
+		if (!m_pexCache->HasDebugInfo(static_cast<int>(identity.id)))
 		{
 			dap::Source source;
-			if (!m_pexCache->GetSourceData(scriptName, source))
+			if (!m_pexCache->GetSourceData(identity, source))
 			{
 				return;
 			}
 			// TODO: Get the modified times from the unlinked objects?
-			auto ref = GetSourceReference(source);
-			if (m_projectSources.find(ref) != m_projectSources.end()) {
-				source = m_projectSources.at(ref);
+			const auto projectSources = m_projectSources.load();
+			if (const auto projectSource = projectSources->find(static_cast<int>(identity.id)); projectSource != projectSources->end()) {
+				source = projectSource->second;
 			}
 			SendEvent(dap::LoadedSourceEvent{
 				.reason = "new",
@@ -302,6 +378,8 @@ namespace DarkId::Papyrus::DebugServer
 	PapyrusDebugger::~PapyrusDebugger()
 	{
 		m_closed = true;
+		CancelLoadedSources();
+		m_worker = nullptr;
 
 		RuntimeEvents::UnsubscribeFromLog(m_logEventHandle);
 		// RuntimeEvents::UnsubscribeFromInitScript(m_initScriptEventHandle);
@@ -326,7 +404,12 @@ namespace DarkId::Papyrus::DebugServer
 			.game = request.game,
 			.projectPath = request.projectPath,
 			.modDirectory = request.modDirectory,
-			.projectSources = request.projectSources
+			.projectSources = request.projectSources,
+			.pexCacheBudget = request.pexCacheBudget,
+			.prefetchScripts = request.prefetchScripts,
+			.threadEventWindow = request.threadEventWindow,
+			.threadEventSummary = request.threadEventSummary,
+			.snapshotOnPause = request.snapshotOnPause
 			});
 		if (resp.error) {
 			RETURN_DAP_ERROR(resp.error.message);
@@ -343,6 +426,25 @@ namespace DarkId::Papyrus::DebugServer
 		{
 			m_pexCache->Clear();
 		}
+		std::vector<std::filesystem::path> looseScriptDirectories;
+		if (!m_modDirectory.empty())
+		{
+			looseScriptDirectories.push_back(std::filesystem::path(m_modDirectory) / "Scripts");
+		}
+		if (!m_projectPath.empty())
+		{
+			// projectPath is usually the .ppj itself
+			auto projectDirectory = std::filesystem::path(m_projectPath);
+			if (projectDirectory.has_extension())
+			{
+				projectDirectory = projectDirectory.parent_path();
+			}
+			looseScriptDirectories.push_back(projectDirectory / "Scripts");
+		}
+		m_pexCache->SetLooseScriptDirectories(std::move(looseScriptDirectories));
+		const auto pexCacheBudget = static_cast<int64_t>(request.pexCacheBudget.value(0));
+		m_pexCache->SetMemoryBudget(pexCacheBudget > 0 ? static_cast<size_t>(pexCacheBudget) * 1024 * 1024 : 0);
+		auto projectSources = std::make_shared<ProjectSources>(*m_projectSources.load());
 		for (auto src : request.projectSources.value(std::vector<dap::Source>())) {
 			auto ref = GetSourceReference(src);
 			if (ref < 0) { // no source ref or name, we'll ignore it
@@ -350,61 +452,87 @@ namespace DarkId::Papyrus::DebugServer
 			}
 			// Don't set the reference on the source or the debugger will attempt to get the source from us
 			// Just put it in the project sources
-			m_projectSources[ref] = src;
+			(*projectSources)[ref] = src;
+		}
+		m_projectSources.store(std::move(projectSources));
+		if (request.prefetchScripts.value(false))
+		{
+			StartPrefetch();
 		}
-		return dap::AttachResponse();
-	}
-
-	dap::ResponseOrError<dap::ContinueResponse> PapyrusDebugger::Continue(const dap::ContinueRequest& request)
-	{
-		if (m_executionManager->Continue())
-			return dap::ContinueResponse();
-		RETURN_DAP_ERROR("Could not Continue");
-	}
 
-	dap::ResponseOrError<dap::PauseResponse> PapyrusDebugger::Pause(const dap::PauseRequest& request)
-	{
-		if (m_executionManager->Pause())
-			return dap::PauseResponse();
-		RETURN_DAP_ERROR("Could not Pause");
+		const auto threadEventWindow = std::chrono::milliseconds(std::max<int64_t>(request.threadEventWindow.value(kDefaultThreadEventWindow), 0));
+		const auto threadEventSummary = request.threadEventSummary.value(false);
+		m_worker->Post([this, threadEventWindow, threadEventSummary]() {
+			m_threadEvents.Configure(threadEventWindow, threadEventSummary);
+		});
+		m_executionManager->SetSnapshotOnPause(request.snapshotOnPause.value(false));
+		return dap::AttachResponse();
 	}
 
-	dap::ResponseOrError<dap::ThreadsResponse> PapyrusDebugger::GetThreads(const dap::ThreadsRequest& request)
+	void PapyrusDebugger::StartPrefetch()
 	{
-		dap::ThreadsResponse response;
-		const auto vm = RE::BSScript::Internal::VirtualMachine::GetSingleton();
-		RE::BSSpinLockGuard lock(vm->runningStacksLock);
+		std::vector<const ScriptIdentity*> scripts;
+		std::unordered_set<uint32_t> queued;
 
-		std::vector<std::string> stackIdPaths;
-
-		for (auto& elem : vm->allRunningStacks)
+		// project scripts are the ones breakpoints and stack traces are most likely to need
+		const auto projectSources = m_projectSources.load();
+		for (const auto& [ref, source] : *projectSources)
 		{
-			const auto stack = elem.second.get();
-			if (!stack || !stack->top)
+			if (!source.name.has_value())
 			{
 				continue;
 			}
-
-			stackIdPaths.push_back(std::to_string(stack->stackID));
+			const auto& identity = ScriptIdentityCache::GetSingleton().Get(source.name.value());
+			if (queued.insert(identity.id).second)
+			{
+				scripts.push_back(&identity);
+			}
 		}
 
-		for (auto& path : stackIdPaths)
+		// everything else loaded in the VM only gets its debug info, which is what resolving stack frames needs
+		const auto binaryCount = scripts.size();
+		// The VM needs typeInfoLock to run scripts, so only copy the types under it and intern them afterwards
+		std::vector<RE::BSTSmartPointer<RE::BSScript::ObjectTypeInfo>> types;
 		{
-			std::shared_ptr<StateNodeBase> stateNode;
-			if (!m_runtimeState->ResolveStateByPath(path, stateNode))
+			const auto vm = RE::BSScript::Internal::VirtualMachine::GetSingleton();
+			RE::BSSpinLockGuard lock(vm->typeInfoLock);
+			types.reserve(vm->objectTypeMap.size());
+			for (const auto& script : vm->objectTypeMap)
 			{
-				continue;
+				types.push_back(script.second);
 			}
-
-			const auto node = dynamic_cast<StackStateNode*>(stateNode.get());
-
-			dap::Thread thread;
-			if (node->SerializeToProtocol(thread))
+		}
+		for (const auto& type : types)
+		{
+			const auto& identity = ScriptIdentityCache::GetSingleton().Get(type.get());
+			if (queued.insert(identity.id).second)
 			{
-				response.threads.push_back(thread);
+				scripts.push_back(&identity);
 			}
 		}
 
+		m_pexPrefetcher->Start(std::move(scripts), binaryCount, m_clientSupportsProgress ? m_session.load() : nullptr);
+	}
+
+	dap::ResponseOrError<dap::ContinueResponse> PapyrusDebugger::Continue(const dap::ContinueRequest& request)
+	{
+		const auto singleThread = request.singleThread.value(false);
+		if (m_executionManager->Continue(static_cast<uint32_t>(request.threadId), singleThread))
+			return dap::ContinueResponse{ .allThreadsContinued = !singleThread };
+		RETURN_DAP_ERROR("Could not Continue");
+	}
+
+	dap::ResponseOrError<dap::PauseResponse> PapyrusDebugger::Pause(const dap::PauseRequest& request)
+	{
+		if (m_executionManager->Pause())
+			return dap::PauseResponse();
+		RETURN_DAP_ERROR("Could not Pause");
+	}
+
+	dap::ResponseOrError<dap::ThreadsResponse> PapyrusDebugger::GetThreads(const dap::ThreadsRequest& request)
+	{
+		dap::ThreadsResponse response;
+		m_runtimeState->GetThreads(response.threads);
 		return response;
 	}
 
@@ -414,18 +542,27 @@ namespace DarkId::Papyrus::DebugServer
 	{
 		dap::Source source = request.source;
 		auto ref = GetSourceReference(source);
-		if (m_projectSources.find(ref) != m_projectSources.end()) {
-			if (!CompareSourceModifiedTime(request.source, m_projectSources[ref])) {
+		const auto projectSources = m_projectSources.load();
+		if (const auto projectSource = projectSources->find(ref); projectSource != projectSources->end()) {
+			if (!CompareSourceModifiedTime(request.source, projectSource->second)) {
 				RETURN_DAP_ERROR("Setting Breakpoints failed: script has been modified after load");
 			}
-			source = m_projectSources[ref];
+			source = projectSource->second;
 		} else if (ref > 0){
 			// It's not part of the project's imported sources, they have to get the decompiled source from us,
 			// So we set sourceReference to make the debugger request the source from us
 			// TODO: Enable this when we start loading the project's sources
 			// source.sourceReference = ref;
 		}
-		return m_breakpointManager->SetBreakpoints(source, request.breakpoints.value(std::vector<dap::SourceBreakpoint>()));;
+		auto response = m_breakpointManager->SetBreakpoints(source, request.breakpoints.value(std::vector<dap::SourceBreakpoint>()));
+		m_executionManager->SetBreakpointsArmed(m_breakpointManager->HasBreakpoints());
+		return response;
+	}
+
+	dap::ResponseOrError<dap::BreakpointLocationsResponse> PapyrusDebugger::GetBreakpointLocations(const dap::BreakpointLocationsRequest& request)
+	{
+		const auto line = static_cast<int>(request.line);
+		return m_breakpointManager->GetBreakpointLocations(request.source, line, static_cast<int>(request.endLine.value(line)));
 	}
 
 	dap::ResponseOrError<dap::SetFunctionBreakpointsResponse> PapyrusDebugger::SetFunctionBreakpoints(const dap::SetFunctionBreakpointsRequest& request)
@@ -435,8 +572,6 @@ namespace DarkId::Papyrus::DebugServer
 	dap::ResponseOrError<dap::StackTraceResponse> PapyrusDebugger::GetStackTrace(const dap::StackTraceRequest& request)
 	{
 		dap::StackTraceResponse response;
-		const auto vm = RE::BSScript::Internal::VirtualMachine::GetSingleton();
-		RE::BSSpinLockGuard lock(vm->runningStacksLock);
 
 		if (request.threadId <= -1)
 		{
@@ -445,45 +580,38 @@ namespace DarkId::Papyrus::DebugServer
 		}
 		auto frameVal = request.startFrame.value(0);
 		auto levelVal = request.levels.value(0);
-		std::vector<std::shared_ptr<StateNodeBase>> frameNodes;
-		if (!m_runtimeState->ResolveChildrenByParentPath(std::to_string(request.threadId), frameNodes))
+		std::vector<dap::StackFrame> frames;
+		if (!m_runtimeState->SerializeStackFrames(static_cast<uint32_t>(request.threadId), m_pexCache.get(), frames))
 		{
 			RETURN_DAP_ERROR("Could not find ThreadId");
 		}
 		uint32_t startFrame = static_cast<uint32_t>(frameVal > 0 ? frameVal : dap::integer(0));
 		uint32_t levels = static_cast<uint32_t>(levelVal > 0 ? levelVal : dap::integer(0));
 
-		for (uint32_t frameIndex = startFrame; frameIndex < frameNodes.size() && frameIndex < startFrame + levels; frameIndex++)
+		for (uint32_t frameIndex = startFrame; frameIndex < frames.size() && frameIndex < startFrame + levels; frameIndex++)
 		{
-			const auto node = dynamic_cast<StackFrameStateNode*>(frameNodes.at(frameIndex).get());
-
-			dap::StackFrame frame;
-			if (!node->SerializeToProtocol(frame, m_pexCache.get())) {
-				RETURN_DAP_ERROR("Serialization error");
-			}
-
-			response.stackFrames.push_back(frame);
+			response.stackFrames.push_back(std::move(frames.at(frameIndex)));
 		}
 		return response;
 	}
 	dap::ResponseOrError<dap::StepInResponse> PapyrusDebugger::StepIn(const dap::StepInRequest& request)
 	{
 		// TODO: Support `granularity` and `target`
-		if (m_executionManager->Step(static_cast<uint32_t>(request.threadId), STEP_IN)) {
+		if (m_executionManager->Step(static_cast<uint32_t>(request.threadId), STEP_IN, request.singleThread.value(false))) {
 			return dap::StepInResponse();
 		}
 		RETURN_DAP_ERROR("Could not StepIn");
 	}
 	dap::ResponseOrError<dap::StepOutResponse> PapyrusDebugger::StepOut(const dap::StepOutRequest& request)
 	{
-		if (m_executionManager->Step(static_cast<uint32_t>(request.threadId), STEP_OUT)) {
+		if (m_executionManager->Step(static_cast<uint32_t>(request.threadId), STEP_OUT, request.singleThread.value(false))) {
 			return dap::StepOutResponse();
 		}
 		RETURN_DAP_ERROR("Could not StepOut");
 	}
 	dap::ResponseOrError<dap::NextResponse> PapyrusDebugger::Next(const dap::NextRequest& request)
 	{
-		if (m_executionManager->Step(static_cast<uint32_t>(request.threadId), STEP_OVER)) {
+		if (m_executionManager->Step(static_cast<uint32_t>(request.threadId), STEP_OVER, request.singleThread.value(false))) {
 			return dap::NextResponse();
 		}
 		RETURN_DAP_ERROR("Could not Next");
@@ -491,33 +619,16 @@ namespace DarkId::Papyrus::DebugServer
 	dap::ResponseOrError<dap::ScopesResponse> PapyrusDebugger::GetScopes(const dap::ScopesRequest& request)
 	{
 		dap::ScopesResponse response;
-		const auto vm = RE::BSScript::Internal::VirtualMachine::GetSingleton();
-		RE::BSSpinLockGuard lock(vm->runningStacksLock);
 
-		std::vector<std::shared_ptr<StateNodeBase>> frameScopes;
 		if (request.frameId < 0) {
 			RETURN_DAP_ERROR(std::format("invalid frameId {}", static_cast<int64_t>(request.frameId)));
 		}
 		auto frameId = static_cast<uint32_t>(request.frameId);
-		if (!m_runtimeState->ResolveChildrenByParentId(frameId, frameScopes)) {
-			RETURN_DAP_ERROR( std::format("No scopes for frameId {}", frameId) );
+		if (m_runtimeState->IsStale(frameId)) {
+			RETURN_DAP_ERROR(std::format("frameId {} is from an earlier pause", frameId));
 		}
-
-		for (const auto& frameScope : frameScopes)
-		{
-			auto asScopeSerializable = dynamic_cast<IProtocolScopeSerializable*>(frameScope.get());
-			if (!asScopeSerializable)
-			{
-				continue;
-			}
-
-			dap::Scope scope;
-			if (!asScopeSerializable->SerializeToProtocol(scope))
-			{
-				continue;
-			}
-			
-			response.scopes.push_back(scope);
+		if (!m_runtimeState->SerializeScopes(frameId, response.scopes)) {
+			RETURN_DAP_ERROR( std::format("No scopes for frameId {}", frameId) );
 		}
 
 		return response;
@@ -527,36 +638,20 @@ namespace DarkId::Papyrus::DebugServer
 	{
 		dap::VariablesResponse response;
 
-		const auto vm = RE::BSScript::Internal::VirtualMachine::GetSingleton();
-		RE::BSSpinLockGuard lock(vm->runningStacksLock);
-
-		std::vector<std::shared_ptr<StateNodeBase>> variableNodes;
-		if (!m_runtimeState->ResolveChildrenByParentId(static_cast<uint32_t>(request.variablesReference), variableNodes)) {
-			RETURN_DAP_ERROR(std::format("No such variable reference {}", static_cast<uint32_t>(request.variablesReference)));
+		const auto variablesReference = static_cast<uint32_t>(request.variablesReference);
+		if (m_runtimeState->IsStale(variablesReference)) {
+			RETURN_DAP_ERROR(std::format("Variable reference {} is from an earlier pause", variablesReference));
 		}
 
-		// TODO: support `start`, `filter`, parameter
-		int64_t count = 0;
-		int64_t maxCount = request.count.value(variableNodes.size());
-		for (const auto& variableNode : variableNodes)
-		{
-			if (count > maxCount) {
-				break;
-			}
-			auto asVariableSerializable = dynamic_cast<IProtocolVariableSerializable*>(variableNode.get());
-			if (!asVariableSerializable)
-			{
-				continue;
-			}
-
-			dap::Variable variable;
-			if (!asVariableSerializable->SerializeToProtocol(variable))
-			{
-				continue;
-			}
-			
-			response.variables.push_back(variable);
-			count++;
+		const auto filter = request.filter.value("");
+		const VariablesPage page{
+			.named = filter != "indexed",
+			.indexed = filter != "named",
+			.start = static_cast<uint32_t>(std::max<int64_t>(request.start.value(0), 0)),
+			.count = static_cast<uint32_t>(std::max<int64_t>(request.count.value(0), 0))
+		};
+		if (!m_runtimeState->SerializeVariables(variablesReference, page, response.variables)) {
+			RETURN_DAP_ERROR(std::format("No such variable reference {}", variablesReference));
 		}
 
 		return response;
@@ -574,29 +669,173 @@ namespace DarkId::Papyrus::DebugServer
 		RETURN_DAP_ERROR("Could not find source " + name);
 	}
 
+	dap::ResponseOrError<dap::PDSDecompiledSourceResponse> PapyrusDebugger::GetDecompiledSource(const dap::PDSDecompiledSourceRequest& request)
+	{
+		if (!request.source.name.has_value()) {
+			RETURN_DAP_ERROR("No source name");
+		}
+		const auto& identity = ScriptIdentityCache::GetSingleton().Get(request.source.name.value());
+
+		DecompiledScript decompiled;
+		if (request.functionName.has_value()) {
+			// the object is the script itself unless the client says otherwise
+			if (!m_pexCache->GetDecompiledFunction(identity, request.objectName.value(identity.normalizedName), request.stateName.value(""), request.functionName.value(), decompiled)) {
+				RETURN_DAP_ERROR(std::format("Could not find function {} in {}", request.functionName.value(), identity.normalizedName));
+			}
+		}
+		else if (!m_pexCache->GetDecompiledSkeleton(identity, decompiled)) {
+			RETURN_DAP_ERROR("Could not find source " + identity.normalizedName);
+		}
+
+		dap::PDSDecompiledSourceResponse response;
+		response.content = std::move(decompiled.source);
+		for (const auto& function : decompiled.functions) {
+			response.functions.push_back(dap::PDSDecompiledFunction{
+				.stateName = function.stateName,
+				.functionName = function.functionName,
+				.startLine = dap::integer(function.startLine),
+				.endLine = dap::integer(function.endLine)
+			});
+		}
+		return response;
+	}
+
 	dap::ResponseOrError<dap::LoadedSourcesResponse> PapyrusDebugger::GetLoadedSources(const dap::LoadedSourcesRequest& request)
 	{
-		dap::LoadedSourcesResponse response;
-		const auto vm = RE::BSScript::Internal::VirtualMachine::GetSingleton();
-		RE::BSSpinLockGuard lock(vm->typeInfoLock);
+		// The VM needs typeInfoLock to run scripts, so only copy the types under it and intern them afterwards
+		std::vector<RE::BSTSmartPointer<RE::BSScript::ObjectTypeInfo>> types;
+		{
+			const auto vm = RE::BSScript::Internal::VirtualMachine::GetSingleton();
+			RE::BSSpinLockGuard lock(vm->typeInfoLock);
+			types.reserve(vm->objectTypeMap.size());
+			for (const auto& script : vm->objectTypeMap)
+			{
+				types.push_back(script.second);
+			}
+		}
+		std::vector<const ScriptIdentity*> identities;
+		identities.reserve(types.size());
+		for (const auto& type : types)
+		{
+			identities.push_back(&ScriptIdentityCache::GetSingleton().Get(type.get()));
+		}
 
-		for (const auto& script : vm->objectTypeMap)
+		// Answer right away with what we already know about; the rest follow as loadedSource events
+		dap::LoadedSourcesResponse response;
+		const auto projectSources = m_projectSources.load();
+		std::vector<const ScriptIdentity*> unresolved;
+		for (const auto identity : identities)
 		{
 			dap::Source source;
-			std::string scriptName = script.first.c_str();
-			if (m_pexCache->GetSourceData(scriptName, source))
+			if (m_pexCache->HasDebugInfo(static_cast<int>(identity->id)) && GetLoadedSource(*identity, *projectSources, source))
 			{
-				auto ref = GetSourceReference(source);
-				// TODO: Get the modified times from the unlinked objects?
-				if (m_projectSources.find(ref) != m_projectSources.end()) {
-					response.sources.push_back(m_projectSources[ref]);
-				} else {
-					response.sources.push_back(source);
-				}
+				response.sources.push_back(source);
+			}
+			else
+			{
+				unresolved.push_back(identity);
 			}
 		}
+
+		CancelLoadedSources();
+		if (!unresolved.empty())
+		{
+			m_loadedSourcesCancelled = false;
+			// the worker keeps this snapshot, so a later attach or launch replacing the project sources doesn't affect it
+			m_loadedSourcesWorker = std::thread(&PapyrusDebugger::ResolveLoadedSources, this, std::move(unresolved), projectSources);
+		}
 		// TODO: Make this check to see if we've loaded any scripts from the project
 		// and if not, emit a message to the user that no project scripts have been loaded
 		return response;
 	}
+
+	bool PapyrusDebugger::GetLoadedSource(const ScriptIdentity& identity, const ProjectSources& projectSources, dap::Source& source)
+	{
+		if (!m_pexCache->GetSourceData(identity, source))
+		{
+			return false;
+		}
+		// TODO: Get the modified times from the unlinked objects?
+		const auto projectSource = projectSources.find(static_cast<int>(identity.id));
+		if (projectSource != projectSources.end()) {
+			source = projectSource->second;
+		}
+		return true;
+	}
+
+	void PapyrusDebugger::ResolveLoadedSources(std::vector<const ScriptIdentity*> identities, std::shared_ptr<const ProjectSources> projectSources)
+	{
+		// each one is a separate PEX read, so they parallelize well; like the prefetcher, leave most of the cores to the game
+		std::atomic<size_t> nextIdentity = 0;
+		const auto resolve = [&]() {
+			while (!m_loadedSourcesCancelled)
+			{
+				const auto index = nextIdentity.fetch_add(1);
+				if (index >= identities.size())
+				{
+					break;
+				}
+
+				dap::Source source;
+				if (GetLoadedSource(*identities[index], *projectSources, source) && !m_loadedSourcesCancelled)
+				{
+					SendEvent(dap::LoadedSourceEvent{
+						.reason = "new",
+						.source = source
+					});
+				}
+			}
+		};
+
+		const auto workerCount = std::clamp<size_t>(std::thread::hardware_concurrency() / 2, 1, 4);
+		std::vector<std::thread> helpers;
+		for (size_t i = 1; i < workerCount; i++)
+		{
+			helpers.emplace_back(resolve);
+		}
+		resolve();
+		for (auto& helper : helpers)
+		{
+			helper.join();
+		}
+	}
+
+	void PapyrusDebugger::CancelLoadedSources()
+	{
+		m_loadedSourcesCancelled = true;
+		if (m_loadedSourcesWorker.joinable())
+		{
+			m_loadedSourcesWorker.join();
+		}
+	}
+
+	dap::ResponseOrError<dap::PDSDebuggerStatsResponse> PapyrusDebugger::GetDebuggerStats(const dap::PDSDebuggerStatsRequest& request)
+	{
+		const auto toMicroseconds = [](const std::chrono::nanoseconds duration) {
+			return dap::number(std::chrono::duration<double, std::micro>(duration).count());
+		};
+
+		dap::PDSDebuggerStatsResponse response;
+		const auto resumeLatency = m_executionManager->GetResumeLatencyStats();
+		response.resumeLatencySampleCount = resumeLatency.sampleCount;
+		response.resumeLatencyP50 = toMicroseconds(resumeLatency.p50);
+		response.resumeLatencyP90 = toMicroseconds(resumeLatency.p90);
+		response.resumeLatencyP99 = toMicroseconds(resumeLatency.p99);
+		response.resumeLatencyMax = toMicroseconds(resumeLatency.max);
+
+		const auto instructionHook = RuntimeEvents::GetInstructionHookStats();
+		response.instructionHookArmed = instructionHook.armed;
+		response.instructionHookArmCount = instructionHook.armCount;
+		response.instructionHookArmedTime = toMicroseconds(instructionHook.totalArmedTime);
+
+		const auto pexCache = m_pexCache->GetStats();
+		response.pexCacheHits = static_cast<dap::integer>(pexCache.hits);
+		response.pexCacheMisses = static_cast<dap::integer>(pexCache.misses);
+		response.pexCacheEvictions = static_cast<dap::integer>(pexCache.evictions);
+		response.pexCacheScripts = static_cast<dap::integer>(pexCache.scriptCount);
+		response.pexCacheFootprint = static_cast<dap::integer>(pexCache.footprint);
+		response.pexCacheBudget = static_cast<dap::integer>(pexCache.memoryBudget);
+
+		return response;
+	}
 }
@@ -5,10 +5,14 @@
 #include <dap/traits.h>
 #include "RuntimeEvents.h"
 #include "PexCache.h"
+#include "PexPrefetcher.h"
 #include "BreakpointManager.h"
 #include "DebugExecutionManager.h"
+#include "DebuggerWorker.h"
+#include "ThreadEventCoalescer.h"
 #include "IdMap.h"
 #include <forward_list>
+#include <thread>
 #include <Protocol/struct_extensions.h>
 
 namespace DarkId::Papyrus::DebugServer
@@ -27,10 +31,14 @@ namespace DarkId::Papyrus::DebugServer
 		VariablesIndexed,
 		VariablesBoth
 	};
+	// Stacks shorter-lived than this aren't reported as threads unless the client asks otherwise
+	constexpr int64_t kDefaultThreadEventWindow = 100;
+
 	class PapyrusDebugger
 	{
 		template <typename T>
 		using IsEvent = dap::traits::EnableIfIsType<dap::Event, T>;
+		using ProjectSources = std::map<int, dap::Source>;
 
 	public:
 		PapyrusDebugger();
@@ -58,6 +66,7 @@ namespace DarkId::Papyrus::DebugServer
 		dap::ResponseOrError<dap::PauseResponse> Pause(const dap::PauseRequest& request) ;
 		dap::ResponseOrError<dap::ThreadsResponse> GetThreads(const dap::ThreadsRequest& request) ;
 		dap::ResponseOrError<dap::SetBreakpointsResponse> SetBreakpoints(const dap::SetBreakpointsRequest& request) ;
+		dap::ResponseOrError<dap::BreakpointLocationsResponse> GetBreakpointLocations(const dap::BreakpointLocationsRequest& request);
 		dap::ResponseOrError<dap::SetFunctionBreakpointsResponse> SetFunctionBreakpoints(const dap::SetFunctionBreakpointsRequest& request);
 		dap::ResponseOrError<dap::StackTraceResponse> GetStackTrace(const dap::StackTraceRequest& request) ;
 		dap::ResponseOrError<dap::StepInResponse> StepIn(const dap::StepInRequest& request);
@@ -67,6 +76,8 @@ namespace DarkId::Papyrus::DebugServer
 		dap::ResponseOrError<dap::VariablesResponse> GetVariables(const dap::VariablesRequest& request);
 		dap::ResponseOrError<dap::SourceResponse> GetSource(const dap::SourceRequest& request);
 		dap::ResponseOrError<dap::LoadedSourcesResponse> GetLoadedSources(const dap::LoadedSourcesRequest& request);
+		dap::ResponseOrError<dap::PDSDebuggerStatsResponse> GetDebuggerStats(const dap::PDSDebuggerStatsRequest& request);
+		dap::ResponseOrError<dap::PDSDecompiledSourceResponse> GetDecompiledSource(const dap::PDSDecompiledSourceRequest& request);
 		// dap::Response Evaluate(const dap::SetBreakpointsRequest& request)  { return 0; }
 		// dap::Response SetVariable(const dap::SetBreakpointsRequest& request)  { return 0; }
 		// dap::Response SetVariableByExpression(const dap::SetBreakpointsRequest& request)  { return 0; }
@@ -74,20 +85,40 @@ namespace DarkId::Papyrus::DebugServer
 		// int GetNamedVariables(uint64_t variablesReference) ;
 	//	void bind(const std::shared_ptr<dap::Session>& session);
 	private:
-		bool m_closed = false;
+		std::atomic<bool> m_closed = false;
+
+		// Stacks started before they had a frame to tell which script they're running
+		struct PendingSourceCheck
+		{
+			uint32_t stackId;
+			uint32_t attempts = 0;
+		};
 
 		std::atomic<uint64_t> msg_counter = 0;
 		std::shared_ptr<IdProvider> m_idProvider;
 
-		std::shared_ptr<dap::Session> m_session;
+		// the worker and game threads send events through it while a session starts or ends
+		std::atomic<std::shared_ptr<dap::Session>> m_session;
 		std::shared_ptr<PexCache> m_pexCache;
+		std::shared_ptr<PexPrefetcher> m_pexPrefetcher;
+		bool m_clientSupportsProgress = false;
+		// resolves the loaded sources that weren't ready for the loadedSources response
+		std::thread m_loadedSourcesWorker;
+		std::atomic<bool> m_loadedSourcesCancelled = false;
 		std::shared_ptr<BreakpointManager> m_breakpointManager;
 		std::shared_ptr<RuntimeState> m_runtimeState;
 		std::shared_ptr<DebugExecutionManager> m_executionManager;
-		std::map<int, dap::Source> m_projectSources;
+		// Replaced as a whole by attach and EndSession; the worker and request threads read whichever one is current
+		std::atomic<std::shared_ptr<const ProjectSources>> m_projectSources = std::make_shared<const ProjectSources>();
 		std::string m_projectPath;
 		std::string m_modDirectory;
 		std::mutex m_instructionMutex;
+		// stack notifications and first-seen script loading; game threads only post to it
+		std::unique_ptr<DebuggerWorker> m_worker;
+		// only touched on the worker thread
+		std::vector<PendingSourceCheck> m_pendingSourceChecks;
+		ThreadEventCoalescer m_threadEvents;
+		ThreadEventCoalescer::Clock::time_point m_lastThreadSummary;
 
 		RuntimeEvents::CreateStackEventHandle m_createStackEventHandle;
 		RuntimeEvents::CleanupStackEventHandle m_cleanupStackEventHandle;
@@ -103,7 +134,14 @@ namespace DarkId::Papyrus::DebugServer
 		void StackCreated(RE::BSTSmartPointer<RE::BSScript::Stack>& stack);
 		void StackCleanedUp(uint32_t stackId);
 		void InstructionExecution(CodeTasklet* tasklet) const;
-		void CheckSourceLoaded(const std::string &scriptName) const;
+		void CheckSourceLoaded(const ScriptIdentity& identity) const;
+		// false if the stack doesn't have a frame yet
+		bool CheckStackSourceLoaded(uint32_t stackId);
+		void WorkerTick();
+		void StartPrefetch();
+		bool GetLoadedSource(const ScriptIdentity& identity, const ProjectSources& projectSources, dap::Source& source);
+		void ResolveLoadedSources(std::vector<const ScriptIdentity*> identities, std::shared_ptr<const ProjectSources> projectSources);
+		void CancelLoadedSources();
 		void BreakpointChanged(const dap::Breakpoint& bpoint, const std::string& reason) const;
 };
 }
@@ -1,10 +1,15 @@
 #include "Pex.h"
 
+#include <array>
+#include <cstring>
 #include <sstream>
 #include <regex>
+#include <string_view>
 
 #include "GameInterfaces.h"
 #include "Utilities.h"
+#include "MappedFile.h"
+#include "SpanStreamBuf.h"
 #if SKYRIM
 #include <SKSE/Logger.h>
 #elif FALLOUT
@@ -15,18 +20,227 @@
 
 namespace DarkId::Papyrus::DebugServer
 {
-	bool ReadPexResource(const std::string& scriptName, std::ostream& stream)
+	namespace
+	{
+		constexpr size_t kPexReadChunkSize = 64 * 1024;
+		// magic, version, game id and compilation time
+		constexpr size_t kPexHeaderSize = 16;
+		constexpr uint32_t kPexMagic = 0xFA57C0DE;
+		constexpr uint32_t kPexMagicSwapped = 0xDEC057FA;
+
+		// Reads the rest of a BSResourceNiBinaryStream in large blocks instead of a byte at a time
+		template <typename TStream>
+		void ReadResourceStream(TStream& resourceStream, std::vector<char>& buffer)
+		{
+			size_t size = 0;
+			while (true)
+			{
+				buffer.resize(size + kPexReadChunkSize);
+				const auto start = resourceStream.tell();
+				resourceStream.read(buffer.data() + size, kPexReadChunkSize);
+				const auto read = static_cast<size_t>(resourceStream.tell() - start);
+				size += read;
+				if (read < kPexReadChunkSize)
+				{
+					break;
+				}
+			}
+			buffer.resize(size);
+		}
+
+		bool ParsePexData(const std::string& scriptName, const std::span<const char> data, Pex::Binary& binary)
+		{
+			SpanStreamBuf streamBuf(data);
+			std::istream input(&streamBuf);
+			Pex::FileReader reader(&input);
+			try {
+				reader.read(binary);
+			}
+			catch (const std::exception& e) {
+				// a truncated or corrupt file mustn't end up cached as if it were the script
+				logger::error("Failed to parse PEX resource {}:"sv, scriptName);
+				logger::error("\t{}"sv, e.what());
+				return false;
+			}
+			return true;
+		}
+
+		// Just enough of a PEX reader to get at what precedes the objects: the header, string table and debug info.
+		// Skyrim writes PEX files big-endian, Fallout 4 little-endian; the magic tells us which one we have.
+		class PexSectionReader
+		{
+		public:
+			explicit PexSectionReader(const std::span<const char> data) : m_data(data) {}
+
+			bool Good() const { return m_good; }
+
+			bool ReadMagic()
+			{
+				const auto magic = ReadFixed<uint32_t>();
+				if (magic == kPexMagicSwapped)
+				{
+					m_swap = true;
+					return m_good;
+				}
+				return m_good && magic == kPexMagic;
+			}
+
+			template <typename T>
+			T ReadFixed()
+			{
+				T value{};
+				if (!Require(sizeof(T)))
+				{
+					return value;
+				}
+				std::memcpy(&value, m_data.data() + m_position, sizeof(T));
+				m_position += sizeof(T);
+				if (m_swap)
+				{
+					if constexpr (sizeof(T) == 2)
+					{
+						value = static_cast<T>(_byteswap_ushort(static_cast<uint16_t>(value)));
+					}
+					else if constexpr (sizeof(T) == 4)
+					{
+						value = static_cast<T>(_byteswap_ulong(static_cast<uint32_t>(value)));
+					}
+					else if constexpr (sizeof(T) == 8)
+					{
+						value = static_cast<T>(_byteswap_uint64(static_cast<uint64_t>(value)));
+					}
+				}
+				return value;
+			}
+
+			std::string_view ReadString()
+			{
+				const auto size = ReadFixed<uint16_t>();
+				if (!Require(size))
+				{
+					return {};
+				}
+				const std::string_view value(m_data.data() + m_position, size);
+				m_position += size;
+				return value;
+			}
+
+			void Skip(const size_t size)
+			{
+				if (Require(size))
+				{
+					m_position += size;
+				}
+			}
+		private:
+			std::span<const char> m_data;
+			size_t m_position = 0;
+			bool m_swap = false;
+			bool m_good = true;
+
+			bool Require(const size_t size)
+			{
+				if (!m_good || size > m_data.size() - m_position)
+				{
+					m_good = false;
+				}
+				return m_good;
+			}
+		};
+
+		bool ParsePexDebugInfo(const std::string& scriptName, const std::span<const char> data, ScriptDebugInfo& debugInfo)
+		{
+			PexSectionReader reader(data);
+			if (!reader.ReadMagic())
+			{
+				logger::error("Failed to parse PEX resource {}: not a PEX file"sv, scriptName);
+				return false;
+			}
+
+			// major/minor version, game id
+			reader.Skip(4);
+			debugInfo.compilationTime = static_cast<std::time_t>(reader.ReadFixed<uint64_t>());
+			debugInfo.sourceFileName = reader.ReadString();
+			// user and computer name
+			reader.ReadString();
+			reader.ReadString();
+
+			// views into `data`, only copied for the names debug info refers to
+			std::vector<std::string_view> strings(reader.ReadFixed<uint16_t>());
+			for (auto& string : strings)
+			{
+				string = reader.ReadString();
+			}
+			const auto getString = [&](const uint16_t index) {
+				return index < strings.size() ? std::string(strings[index]) : std::string();
+			};
+
+			debugInfo.modificationTime = 0;
+			debugInfo.functions.clear();
+			if (reader.ReadFixed<uint8_t>() != 0)
+			{
+				debugInfo.modificationTime = static_cast<std::time_t>(reader.ReadFixed<uint64_t>());
+				const auto functionCount = reader.ReadFixed<uint16_t>();
+				debugInfo.functions.reserve(functionCount);
+				for (uint16_t i = 0; i < functionCount && reader.Good(); i++)
+				{
+					auto& function = debugInfo.functions.emplace_back();
+					function.objectName = getString(reader.ReadFixed<uint16_t>());
+					function.stateName = getString(reader.ReadFixed<uint16_t>());
+					function.functionName = getString(reader.ReadFixed<uint16_t>());
+					function.functionType = reader.ReadFixed<uint8_t>();
+					function.lineNumbers.resize(reader.ReadFixed<uint16_t>());
+					for (auto& line : function.lineNumbers)
+					{
+						line = reader.ReadFixed<uint16_t>();
+					}
+				}
+			}
+			// everything after this (Fallout's property groups, user flags and the objects themselves) is left unread
+
+			if (!reader.Good())
+			{
+				logger::error("Failed to parse PEX resource {}: unexpected end of file"sv, scriptName);
+				return false;
+			}
+			return true;
+		}
+
+		// Hands `parse` the script's PEX data: mapped straight from a loose file we know the location of, or read from the game's resources
+		template <typename TParse>
+		bool WithPexData(const std::string& scriptName, const std::vector<std::filesystem::path>& looseScriptDirectories, TParse parse)
+		{
+			const auto pexPath = ScriptNameToPEXPath(scriptName);
+			for (const auto& directory : looseScriptDirectories)
+			{
+				MappedFile file;
+				if (file.Open(directory / pexPath))
+				{
+					return parse(file.GetData());
+				}
+			}
+
+			// reused across loads so parsing scripts one after another doesn't keep reallocating
+			thread_local std::vector<char> buffer;
+
+			if (!ReadPexResource(scriptName, buffer))
+			{
+				logger::error("Failed to load pex resource for script {}"sv, scriptName);
+				return false;
+			}
+
+			return parse(std::span<const char>(buffer));
+		}
+	}
+
+	bool ReadPexResource(const std::string& scriptName, std::vector<char>& buffer)
 	{
 		auto scriptPath = "Scripts/" + ScriptNameToPEXPath(scriptName);
 		RE::BSResourceNiBinaryStream scriptStream(scriptPath);
 		bool good = false;
 		if (scriptStream.good())
 		{
-			char byte;
-			while (scriptStream.get(byte))
-			{
-				stream.put(byte);
-			}
+			ReadResourceStream(scriptStream, buffer);
 			good = true;
 		} 
 		#if FALLOUT
@@ -35,11 +249,7 @@ namespace DarkId::Papyrus::DebugServer
 			auto rescanStream = RE::BSResourceNiBinaryStream::BinaryStreamWithRescan(scriptPath.c_str());
 			if (rescanStream->good())
 			{
-				char byte;
-				while (rescanStream->get(byte))
-				{
-					stream.put(byte);
-				}
+				ReadResourceStream(*rescanStream, buffer);
 				good = true;
 			}
 			delete rescanStream;
@@ -48,9 +258,21 @@ namespace DarkId::Papyrus::DebugServer
 		return good;
 	}
 
+	bool ReadPexResource(const std::string& scriptName, std::ostream& stream)
+	{
+		std::vector<char> buffer;
+		if (!ReadPexResource(scriptName, buffer))
+		{
+			return false;
+		}
+
+		stream.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+		return true;
+	}
+
 
 	bool LoadAndDumpPexData(const std::string& scriptName, std::string outputDir) {
-		std::stringstream buffer;
+		std::vector<char> buffer;
 
 		if (!ReadPexResource(scriptName, buffer))
 		{
@@ -58,9 +280,7 @@ namespace DarkId::Papyrus::DebugServer
 			return false;
 		}
 
-		buffer.seekp(0);
 		// DEBUG
-		std::string scriptFile(scriptName);
 		auto outputPath = std::filesystem::path(outputDir) / (std::string(scriptName) + ".pex");
 		std::ofstream output(outputPath, std::ios::binary);
 		if (output.bad()) {
@@ -68,56 +288,94 @@ namespace DarkId::Papyrus::DebugServer
 			return false;
 
 		}
-		char byte;
-		while (buffer.get(byte)) {
-			output.put(byte);
-		}
+		output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
 		output.close();
 		Pex::Binary thing;
-		auto athing = LoadPexData(scriptName, thing);
-		return true;
+		return ParsePexData(scriptName, buffer, thing);
 	}
 
-	bool LoadPexData(const std::string& scriptName, Pex::Binary& binary)
+	bool ReadPexCompilationTime(const std::string& scriptName, std::time_t& compilationTime, const std::vector<std::filesystem::path>& looseScriptDirectories)
 	{
-		std::stringstream buffer;
+		// magic, major/minor version and game id come before it; nothing variable-length does
+		std::array<char, kPexHeaderSize> header;
+		bool found = false;
 
-		if (!ReadPexResource(scriptName, buffer))
+		const auto pexPath = ScriptNameToPEXPath(scriptName);
+		for (const auto& directory : looseScriptDirectories)
 		{
-			logger::error("Failed to load pex resource for script {}"sv, scriptName);
-			return false;
+			MappedFile file;
+			if (file.Open(directory / pexPath))
+			{
+				const auto data = file.GetData();
+				if (data.size() < header.size())
+				{
+					return false;
+				}
+				std::copy_n(data.begin(), header.size(), header.begin());
+				found = true;
+				break;
+			}
 		}
 
-		buffer.seekp(0);
+		if (!found)
+		{
+			auto scriptPath = "Scripts/" + pexPath;
+			RE::BSResourceNiBinaryStream scriptStream(scriptPath);
+			if (!scriptStream.good())
+			{
+				// Fallout's loose files only show up through a full read, see ReadPexResource
+				std::vector<char> buffer;
+				if (!ReadPexResource(scriptName, buffer) || buffer.size() < header.size())
+				{
+					return false;
+				}
+				std::copy_n(buffer.begin(), header.size(), header.begin());
+			}
+			else
+			{
+				const auto start = scriptStream.tell();
+				scriptStream.read(header.data(), static_cast<uint32_t>(header.size()));
+				if (static_cast<size_t>(scriptStream.tell() - start) < header.size())
+				{
+					return false;
+				}
+			}
+		}
 
-		std::istream input(buffer.rdbuf());
-		Pex::FileReader reader(&input);
-		try {
-			reader.read(binary);
+		uint32_t magic;
+		uint64_t time;
+		std::memcpy(&magic, header.data(), sizeof(magic));
+		std::memcpy(&time, header.data() + 8, sizeof(time));
+		// Skyrim writes PEX files big-endian, Fallout 4 little-endian; the magic tells us which this is
+		if (magic == kPexMagicSwapped)
+		{
+			time = _byteswap_uint64(time);
 		}
-		catch (std::runtime_error e) {
-			logger::error("Failed to parse PEX resource {}:"sv, scriptName);
-			logger::error("\t{}"sv, e.what());
+		else if (magic != kPexMagic)
+		{
+			return false;
 		}
+		compilationTime = static_cast<std::time_t>(time);
 		return true;
 	}
 
-	Pex::Function* GetFunctionData(std::shared_ptr<Pex::Binary> binary, Pex::StringTable::Index objName, Pex::StringTable::Index stateName, Pex::StringTable::Index funcName)
+	bool LoadPexData(const std::string& scriptName, Pex::Binary& binary)
 	{
-		for (auto& object : binary->getObjects()) {
-			if (object.getName() == objName) {
-				for (auto& state : object.getStates()) {
-					if (state.getName() == stateName) {
-						for (auto& function : state.getFunctions()) {
-							if (function.getName() == funcName) {
-								return std::addressof(function);
-							}
-						}
-					}
-				}
-			}
-		}
-		return nullptr;
+		return LoadPexData(scriptName, binary, {});
+	}
+
+	bool LoadPexData(const std::string& scriptName, Pex::Binary& binary, const std::vector<std::filesystem::path>& looseScriptDirectories)
+	{
+		return WithPexData(scriptName, looseScriptDirectories, [&](const std::span<const char> data) {
+			return ParsePexData(scriptName, data, binary);
+		});
+	}
+
+	bool LoadPexDebugInfo(const std::string& scriptName, ScriptDebugInfo& debugInfo, const std::vector<std::filesystem::path>& looseScriptDirectories)
+	{
+		return WithPexData(scriptName, looseScriptDirectories, [&](const std::span<const char> data) {
+			return ParsePexDebugInfo(scriptName, data, debugInfo);
+		});
 	}
 
 	bool OpCodeWillCallOrReturn(Pex::OpCode opcode) {
@@ -2,11 +2,23 @@
 
 #include <Champollion/Pex/Binary.hpp>
 
+#include <ctime>
+#include <filesystem>
+#include <vector>
+
+#include "DebugInfoIndex.h"
+
 namespace DarkId::Papyrus::DebugServer
 {
     bool ReadPexResource(const std::string& scriptName, std::ostream& stream);
+    bool ReadPexResource(const std::string& scriptName, std::vector<char>& buffer);
     bool LoadAndDumpPexData(const std::string& scriptName, std::string outputDir);
     bool LoadPexData(const std::string& scriptName, Pex::Binary& binary);
-	Pex::Function* GetFunctionData(std::shared_ptr<Pex::Binary> binary, Pex::StringTable::Index objName, Pex::StringTable::Index stateName, Pex::StringTable::Index funcName);
+    // Looks for a loose "<directory>/<script path>.pex" in each directory before asking the game's resource manager
+    bool LoadPexData(const std::string& scriptName, Pex::Binary& binary, const std::vector<std::filesystem::path>& looseScriptDirectories);
+    // Reads the header, string table and debug info and stops before the objects; much cheaper than LoadPexData
+    bool LoadPexDebugInfo(const std::string& scriptName, ScriptDebugInfo& debugInfo, const std::vector<std::filesystem::path>& looseScriptDirectories);
+    // Reads only the compilation time from the PEX header, which is enough to tell whether a cached copy of its debug info is current
+    bool ReadPexCompilationTime(const std::string& scriptName, std::time_t& compilationTime, const std::vector<std::filesystem::path>& looseScriptDirectories);
 
 }
@@ -1,91 +1,579 @@
 #include "PexCache.h"
 #include "Pex.h"
+#include "PexDecompiler.h"
 #include "Utilities.h"
 
 #include <functional>
 #include <algorithm>
 #include <string>
-#include <Decompiler/PscCoder.hpp>
-#include <Decompiler/StreamWriter.hpp>
 
 namespace DarkId::Papyrus::DebugServer
 {
-	bool PexCache::HasScript(const int scriptReference)
+	// Rough in-memory size of a parsed binary; it only has to be good enough to compare scripts against a budget
+	size_t EstimateFootprint(const Pex::Binary& binary)
 	{
-		std::lock_guard<std::mutex> scriptLock(m_scriptsMutex);
+		size_t footprint = sizeof(Pex::Binary);
+		for (const auto& object : binary.getObjects())
+		{
+			footprint += sizeof(object);
+			for (const auto& state : object.getStates())
+			{
+				footprint += sizeof(state);
+				for (const auto& function : state.getFunctions())
+				{
+					footprint += sizeof(function);
+					for (const auto& instruction : function.getInstructions())
+					{
+						footprint += sizeof(instruction) + (instruction.getArgs().size() + instruction.getVarArgs().size()) * sizeof(Pex::Value);
+					}
+				}
+			}
+		}
+		for (const auto& funcInfo : binary.getDebugInfo().getFunctionInfos())
+		{
+			footprint += sizeof(funcInfo) + funcInfo.getLineNumbers().size() * sizeof(funcInfo.getLineNumbers()[0]);
+		}
+		return footprint;
+	}
 
-		return m_scripts.find(scriptReference) != m_scripts.end();
+	std::shared_ptr<const PexCache::CachedScript> PexCache::FindEntry(const int ref) const
+	{
+		const auto scripts = GetShard(ref).scripts.load(std::memory_order_acquire);
+		const auto entry = scripts->find(ref);
+		return entry != scripts->end() ? entry->second : nullptr;
 	}
-	bool PexCache::HasScript(const std::string& scriptName)
+
+	bool PexCache::PublishEntry(const int ref, const uint64_t generation, const std::shared_ptr<const CachedScript>& expected, std::shared_ptr<const CachedScript> entry)
 	{
-		return HasScript(GetScriptReference(scriptName));
+		auto& shard = GetShard(ref);
+		std::lock_guard<std::mutex> writeLock(shard.writeMutex);
+		if (m_generation.load() != generation)
+		{
+			return false;
+		}
+
+		const auto current = shard.scripts.load(std::memory_order_acquire);
+		const auto existing = current->find(ref);
+		if ((existing != current->end() ? existing->second : nullptr) != expected)
+		{
+			return false;
+		}
+
+		m_footprint += entry->footprint;
+		if (expected)
+		{
+			m_footprint -= expected->footprint;
+		}
+
+		auto updated = std::make_shared<ScriptMap>(*current);
+		(*updated)[ref] = std::move(entry);
+		shard.scripts.store(std::move(updated), std::memory_order_release);
+		return true;
 	}
-	
-	std::shared_ptr<Pex::Binary> PexCache::GetCachedScript(const int ref) {
-		const auto entry = m_scripts.find(ref);
-		return entry != m_scripts.end() ? entry->second : nullptr;
+
+	void PexCache::Touch(const CachedScript& entry)
+	{
+		entry.lastAccess->store(m_accessClock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
 	}
 
+	void PexCache::EvictToBudget()
+	{
+		const auto budget = m_memoryBudget.load();
+		if (budget == 0 || m_footprint.load() <= budget)
+		{
+			return;
+		}
+
+		// one evictor at a time is plenty; whoever loads next will catch anything we miss
+		std::unique_lock<std::mutex> evictionLock(m_evictionMutex, std::try_to_lock);
+		if (!evictionLock.owns_lock())
+		{
+			return;
+		}
+
+		struct Candidate
+		{
+			int ref;
+			uint64_t lastAccess;
+		};
+		std::vector<Candidate> candidates;
+		{
+			std::lock_guard<std::mutex> pinnedLock(m_pinnedMutex);
+			for (const auto& shard : m_shards)
+			{
+				for (const auto& [ref, entry] : *shard.scripts.load(std::memory_order_acquire))
+				{
+					if (!m_pinned.contains(ref))
+					{
+						candidates.push_back(Candidate{ .ref = ref, .lastAccess = entry->lastAccess->load(std::memory_order_relaxed) });
+					}
+				}
+			}
+		}
+
+		std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+			return a.lastAccess < b.lastAccess;
+		});
+
+		for (const auto& candidate : candidates)
+		{
+			if (m_footprint.load() <= budget)
+			{
+				break;
+			}
+
+			auto& shard = GetShard(candidate.ref);
+			std::lock_guard<std::mutex> writeLock(shard.writeMutex);
+			const auto current = shard.scripts.load(std::memory_order_acquire);
+			const auto existing = current->find(candidate.ref);
+			if (existing == current->end())
+			{
+				continue;
+			}
+
+			// anyone still holding the binary keeps it alive; we only drop the cache's reference
+			m_footprint -= existing->second->footprint;
+			auto updated = std::make_shared<ScriptMap>(*current);
+			updated->erase(candidate.ref);
+			shard.scripts.store(std::move(updated), std::memory_order_release);
+			m_evictions++;
+		}
+	}
+	
 	std::shared_ptr<Pex::Binary> PexCache::GetScript(const std::string& scriptName)
 	{
-		std::lock_guard<std::mutex> scriptLock(m_scriptsMutex);
-		uint32_t reference = GetScriptReference(scriptName);
+		return GetScript(ScriptIdentityCache::GetSingleton().Get(scriptName));
+	}
+
+	std::shared_ptr<Pex::Binary> PexCache::GetScript(const ScriptIdentity& identity)
+	{
+		const int reference = static_cast<int>(identity.id);
+		if (const auto entry = FindEntry(reference))
+		{
+			m_hits.fetch_add(1, std::memory_order_relaxed);
+			Touch(*entry);
+			return entry->binary;
+		}
+		m_misses.fetch_add(1, std::memory_order_relaxed);
+
+		std::promise<std::shared_ptr<Pex::Binary>> loaded;
+		uint64_t generation;
+		{
+			std::unique_lock<std::mutex> loadingLock(m_loadingMutex);
+			// it may have been published while we were waiting for the lock
+			if (const auto entry = FindEntry(reference))
+			{
+				return entry->binary;
+			}
+
+			const auto inFlight = m_loading.find(reference);
+			if (inFlight != m_loading.end())
+			{
+				const auto pending = inFlight->second;
+				loadingLock.unlock();
+				return pending.get();
+			}
+
+			m_loading.emplace(reference, loaded.get_future().share());
+			generation = m_generation.load();
+		}
 
-		const auto entry = m_scripts.find(reference);
-		if (entry == m_scripts.end())
+		// Whatever happens below, the load has to stop being in flight and its waiters have to hear about it,
+		// or every later request for this script would wait on a promise nobody keeps
+		std::shared_ptr<Pex::Binary> binary;
+		try
 		{
-			auto binary = std::make_shared<Pex::Binary>();
-			if (LoadPexData(scriptName, *binary))
+			std::vector<std::filesystem::path> looseScriptDirectories;
 			{
-				m_scripts.emplace(reference, binary);
-				return binary;
+				std::lock_guard<std::mutex> directoriesLock(m_looseScriptDirectoriesMutex);
+				looseScriptDirectories = m_looseScriptDirectories;
 			}
+
+			// the slow part: reading and parsing happen without holding any lock
+			binary = std::make_shared<Pex::Binary>();
+			if (LoadPexData(identity.normalizedName, *binary, looseScriptDirectories))
+			{
+				PublishEntry(reference, generation, nullptr, std::make_shared<const CachedScript>(CachedScript{
+					.binary = binary,
+					.footprint = EstimateFootprint(*binary),
+					.lastAccess = std::make_shared<std::atomic<uint64_t>>(m_accessClock.fetch_add(1, std::memory_order_relaxed) + 1)
+				}));
+			}
+			else
+			{
+				binary = nullptr;
+			}
+		}
+		catch (const std::exception& e)
+		{
+			logger::error("Failed to load script {}: {}"sv, identity.normalizedName, e.what());
+			binary = nullptr;
 		}
 
-		return entry != m_scripts.end() ? entry->second : nullptr;
+		{
+			std::lock_guard<std::mutex> loadingLock(m_loadingMutex);
+			m_loading.erase(reference);
+		}
+		loaded.set_value(binary);
+
+		EvictToBudget();
+		return binary;
 	}
 
-	bool PexCache::GetDecompiledSource(const std::string& scriptName, std::string& decompiledSource)
+	template <typename TIndex, typename TFactory>
+	std::shared_ptr<const TIndex> PexCache::GetIndex(const ScriptIdentity& identity, std::shared_ptr<const TIndex> CachedScript::* member, TFactory factory)
 	{
-		const auto binary = this->GetScript(scriptName);
+		const auto binary = GetScript(identity);
 		if (!binary)
+		{
+			return nullptr;
+		}
+
+		const int reference = static_cast<int>(identity.id);
+		const auto generation = m_generation.load();
+		auto entry = FindEntry(reference);
+		if (entry && entry->binary == binary && (*entry).*member)
+		{
+			return (*entry).*member;
+		}
+
+		// build outside any lock; if two threads race, the index is identical either way
+		std::shared_ptr<const TIndex> index = factory(binary);
+
+		// publish a copy of whatever is current so an index added by another thread isn't lost
+		while (entry && entry->binary == binary)
+		{
+			auto updated = std::make_shared<CachedScript>(*entry);
+			(*updated).*member = index;
+			if (PublishEntry(reference, generation, entry, std::move(updated)))
+			{
+				break;
+			}
+			entry = FindEntry(reference);
+		}
+		return index;
+	}
+
+	std::shared_ptr<const PexCache::CachedDebugInfo> PexCache::GetDebugInfoEntry(const ScriptIdentity& identity)
+	{
+		const int reference = static_cast<int>(identity.id);
+		{
+			std::shared_lock<std::shared_mutex> lock(m_debugInfoMutex);
+			const auto entry = m_debugInfos.find(reference);
+			if (entry != m_debugInfos.end())
+			{
+				return entry->second;
+			}
+		}
+
+		const auto generation = m_generation.load();
+		std::vector<std::filesystem::path> looseScriptDirectories;
+		{
+			std::lock_guard<std::mutex> directoriesLock(m_looseScriptDirectoriesMutex);
+			looseScriptDirectories = m_looseScriptDirectories;
+		}
+
+		std::shared_ptr<const ScriptDebugInfo> debugInfo;
+		std::time_t compilationTime;
+		if (m_debugInfoIndex && ReadPexCompilationTime(identity.normalizedName, compilationTime, looseScriptDirectories))
+		{
+			debugInfo = m_debugInfoIndex->Find(identity.key, compilationTime);
+		}
+
+		if (!debugInfo)
+		{
+			// not indexed yet, or the script was recompiled since; either way only the debug info is read, not the objects
+			auto loaded = std::make_shared<ScriptDebugInfo>();
+			if (!LoadPexDebugInfo(identity.normalizedName, *loaded, looseScriptDirectories))
+			{
+				return nullptr;
+			}
+			debugInfo = loaded;
+			if (m_debugInfoIndex && !debugInfo->functions.empty())
+			{
+				m_debugInfoIndex->Put(identity.key, debugInfo);
+			}
+		}
+
+		auto entry = std::make_shared<const CachedDebugInfo>(CachedDebugInfo{
+			.debugInfo = debugInfo,
+			.lineIndex = std::make_shared<const PexLineIndex>(*debugInfo)
+		});
+
+		std::unique_lock<std::shared_mutex> lock(m_debugInfoMutex);
+		if (m_generation.load() != generation)
+		{
+			return entry;
+		}
+		// if another thread beat us to it, keep theirs so everyone sees the same entry
+		return m_debugInfos.emplace(reference, std::move(entry)).first->second;
+	}
+
+	std::shared_ptr<const ScriptDebugInfo> PexCache::GetDebugInfo(const ScriptIdentity& identity)
+	{
+		const auto entry = GetDebugInfoEntry(identity);
+		return entry ? entry->debugInfo : nullptr;
+	}
+
+	std::shared_ptr<const ScriptDebugInfo> PexCache::GetCachedDebugInfo(const int scriptReference)
+	{
+		std::shared_lock<std::shared_mutex> lock(m_debugInfoMutex);
+		const auto entry = m_debugInfos.find(scriptReference);
+		return entry != m_debugInfos.end() ? entry->second->debugInfo : nullptr;
+	}
+
+	bool PexCache::HasDebugInfo(const int scriptReference)
+	{
+		std::shared_lock<std::shared_mutex> lock(m_debugInfoMutex);
+		return m_debugInfos.contains(scriptReference);
+	}
+
+	std::shared_ptr<const PexLineIndex> PexCache::GetLineIndex(const ScriptIdentity& identity)
+	{
+		const auto entry = GetDebugInfoEntry(identity);
+		return entry ? entry->lineIndex : nullptr;
+	}
+
+	std::shared_ptr<const PexFunctionIndex> PexCache::GetFunctionIndex(const ScriptIdentity& identity)
+	{
+		return GetIndex(identity, &CachedScript::functionIndex, [](const std::shared_ptr<Pex::Binary>& binary) {
+			return std::make_shared<const PexFunctionIndex>(binary);
+		});
+	}
+
+	PexCache::~PexCache()
+	{
+		{
+			std::lock_guard<std::mutex> queueLock(m_decompileQueueMutex);
+			m_decompileWorkerStopping = true;
+		}
+		m_decompileQueueCondition.notify_all();
+		if (m_decompileWorker.joinable())
+		{
+			m_decompileWorker.join();
+		}
+	}
+
+	bool PexCache::GetDecompiledSource(const std::string& scriptName, std::string& decompiledSource)
+	{
+		return GetDecompiledSource(ScriptIdentityCache::GetSingleton().Get(scriptName), decompiledSource);
+	}
+
+	bool PexCache::GetDecompiledSource(const ScriptIdentity& identity, std::string& decompiledSource)
+	{
+		const auto debugInfo = GetDebugInfo(identity);
+		if (!debugInfo)
 		{
 			return false;
 		}
+		if (m_decompiledSources.Get(static_cast<int>(identity.id), debugInfo->modificationTime, decompiledSource))
+		{
+			return true;
+		}
 
-		std::basic_stringstream<char> pscStream;
-		Decompiler::PscCoder coder(new Decompiler::StreamWriter(pscStream));
+		const auto source = Decompile(identity);
+		if (!source)
+		{
+			return false;
+		}
+		decompiledSource = *source;
+		return true;
+	}
 
-		coder.code(*binary);
+	std::shared_ptr<const std::string> PexCache::Decompile(const ScriptIdentity& identity)
+	{
+		const int reference = static_cast<int>(identity.id);
+		std::promise<std::shared_ptr<const std::string>> decompiled;
+		{
+			std::unique_lock<std::mutex> decompilingLock(m_decompilingMutex);
+			const auto inFlight = m_decompiling.find(reference);
+			if (inFlight != m_decompiling.end())
+			{
+				const auto pending = inFlight->second;
+				decompilingLock.unlock();
+				return pending.get();
+			}
+			m_decompiling.emplace(reference, decompiled.get_future().share());
+		}
 
-		decompiledSource = pscStream.str();
+		std::shared_ptr<const std::string> source;
+		const auto debugInfo = GetDebugInfo(identity);
+		const auto binary = GetScript(identity);
+		if (debugInfo && binary)
+		{
+			source = std::make_shared<const std::string>(DecompileScript(*binary));
+			m_decompiledSources.Put(reference, debugInfo->modificationTime, *source);
+		}
 
+		{
+			std::lock_guard<std::mutex> decompilingLock(m_decompilingMutex);
+			m_decompiling.erase(reference);
+		}
+		decompiled.set_value(source);
+		return source;
+	}
+
+	bool PexCache::GetDecompiledSkeleton(const ScriptIdentity& identity, DecompiledScript& decompiled)
+	{
+		const auto binary = GetScript(identity);
+		if (!binary)
+		{
+			return false;
+		}
+		decompiled = DecompileSkeleton(*binary);
 		return true;
 	}
 
+	bool PexCache::GetDecompiledFunction(const ScriptIdentity& identity, const std::string& objectName, const std::string& stateName, const std::string& functionName, DecompiledScript& decompiled)
+	{
+		const auto binary = GetScript(identity);
+		return binary && DecompileFunction(*binary, objectName, stateName, functionName, decompiled);
+	}
+
+	void PexCache::QueueDecompilation(const ScriptIdentity& identity)
+	{
+		if (const auto debugInfo = GetCachedDebugInfo(static_cast<int>(identity.id)))
+		{
+			if (m_decompiledSources.Contains(static_cast<int>(identity.id), debugInfo->modificationTime))
+			{
+				return;
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> queueLock(m_decompileQueueMutex);
+			if (m_decompileWorkerStopping || !m_decompileQueued.insert(&identity).second)
+			{
+				return;
+			}
+			m_decompileQueue.push_back(&identity);
+			if (!m_decompileWorker.joinable())
+			{
+				m_decompileWorker = std::thread(&PexCache::DecompileWorker, this);
+			}
+		}
+		m_decompileQueueCondition.notify_one();
+	}
+
+	void PexCache::DecompileWorker()
+	{
+		while (true)
+		{
+			const ScriptIdentity* identity;
+			{
+				std::unique_lock<std::mutex> queueLock(m_decompileQueueMutex);
+				m_decompileQueueCondition.wait(queueLock, [this] { return m_decompileWorkerStopping || !m_decompileQueue.empty(); });
+				if (m_decompileWorkerStopping)
+				{
+					return;
+				}
+				identity = m_decompileQueue.front();
+				m_decompileQueue.pop_front();
+				m_decompileQueued.erase(identity);
+			}
+
+			std::string source;
+			GetDecompiledSource(*identity, source);
+		}
+	}
+
 	bool PexCache::GetSourceData(const std::string& scriptName, dap::Source& data)
 	{
-		const int sourceReference = GetScriptReference(scriptName);
+		return GetSourceData(ScriptIdentityCache::GetSingleton().Get(scriptName), data);
+	}
 
-		auto binary = GetScript(scriptName);
-		if (!binary)
+	bool PexCache::GetSourceData(const ScriptIdentity& identity, dap::Source& data)
+	{
+		const auto debugInfo = GetDebugInfo(identity);
+		if (!debugInfo)
 		{
 			return false;
 		}
-		std::string normname = NormalizeScriptName(scriptName);
 
-		auto headerSrcName = binary->getHeader().getSourceFileName();
+		auto headerSrcName = debugInfo->sourceFileName;
 		if (headerSrcName.empty()) {
-			headerSrcName = ScriptNameToPSCPath(normname);
+			headerSrcName = identity.pscPath;
 		}
-		data.name = normname;
+		data.name = identity.normalizedName;
 		data.path = headerSrcName;
-		data.sourceReference = sourceReference;
+		data.sourceReference = static_cast<int>(identity.id);
 		return true;
 	}
 
 	void PexCache::Clear() {
-		std::lock_guard<std::mutex> scriptLock(m_scriptsMutex);
-		m_scripts.clear();
+		m_generation++;
+		for (auto& shard : m_shards)
+		{
+			std::lock_guard<std::mutex> writeLock(shard.writeMutex);
+			for (const auto& [ref, entry] : *shard.scripts.load(std::memory_order_acquire))
+			{
+				m_footprint -= entry->footprint;
+			}
+			shard.scripts.store(std::make_shared<const ScriptMap>(), std::memory_order_release);
+		}
+
+		{
+			std::unique_lock<std::shared_mutex> debugInfoLock(m_debugInfoMutex);
+			m_debugInfos.clear();
+		}
+		m_decompiledSources.Clear();
+	}
+
+	void PexCache::OpenDebugInfoIndex(std::filesystem::path path)
+	{
+		m_debugInfoIndex = std::make_unique<DebugInfoIndex>(std::move(path));
+		m_debugInfoIndex->Load();
+	}
+
+	void PexCache::SaveDebugInfoIndex()
+	{
+		if (m_debugInfoIndex)
+		{
+			m_debugInfoIndex->Save();
+		}
+	}
+
+	void PexCache::SetMemoryBudget(const size_t bytes) {
+		m_memoryBudget = bytes;
+		EvictToBudget();
+	}
+
+	void PexCache::SetPinned(const int scriptReference, const bool pinned) {
+		std::lock_guard<std::mutex> pinnedLock(m_pinnedMutex);
+		if (pinned)
+		{
+			m_pinned.insert(scriptReference);
+		}
+		else
+		{
+			m_pinned.erase(scriptReference);
+		}
+	}
+
+	void PexCache::ClearPinned() {
+		std::lock_guard<std::mutex> pinnedLock(m_pinnedMutex);
+		m_pinned.clear();
+	}
+
+	PexCacheStats PexCache::GetStats() const {
+		size_t scriptCount = 0;
+		for (const auto& shard : m_shards)
+		{
+			scriptCount += shard.scripts.load(std::memory_order_acquire)->size();
+		}
+
+		return PexCacheStats{
+			.hits = m_hits.load(),
+			.misses = m_misses.load(),
+			.evictions = m_evictions.load(),
+			.scriptCount = scriptCount,
+			.footprint = m_footprint.load(),
+			.memoryBudget = m_memoryBudget.load()
+		};
+	}
+
+	void PexCache::SetLooseScriptDirectories(std::vector<std::filesystem::path> directories) {
+		std::lock_guard<std::mutex> directoriesLock(m_looseScriptDirectoriesMutex);
+		m_looseScriptDirectories = std::move(directories);
 	}
 }
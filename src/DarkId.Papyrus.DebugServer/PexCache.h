@@ -1,30 +1,160 @@
 #pragma once
 
 #include <Champollion/Pex/Binary.hpp>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <dap/protocol.h>
+#include <filesystem>
 #include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+#include "ScriptIdentityCache.h"
+#include "PexIndex.h"
+#include "DebugInfoIndex.h"
+#include "DecompiledSourceCache.h"
+#include "PexDecompiler.h"
 
 namespace DarkId::Papyrus::DebugServer
 
 {
+	struct PexCacheStats
+	{
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+		size_t scriptCount;
+		// estimated bytes held by cached binaries
+		size_t footprint;
+		// 0 when unlimited
+		size_t memoryBudget;
+	};
+
 	class PexCache
 	{
 	public:
 		PexCache() = default;
-
-		bool HasScript(int scriptReference);
-		bool HasScript(const std::string & scriptName);
-
-		std::shared_ptr<Pex::Binary> GetCachedScript(const int ref);
+		~PexCache();
 
 		std::shared_ptr<Pex::Binary> GetScript(const std::string & scriptName);
+		std::shared_ptr<Pex::Binary> GetScript(const ScriptIdentity& identity);
+		// Debug info comes from the on-disk index when it's current, so it doesn't require parsing the script
+		std::shared_ptr<const ScriptDebugInfo> GetDebugInfo(const ScriptIdentity& identity);
+		std::shared_ptr<const ScriptDebugInfo> GetCachedDebugInfo(int scriptReference);
+		bool HasDebugInfo(int scriptReference);
+		std::shared_ptr<const PexLineIndex> GetLineIndex(const ScriptIdentity& identity);
+		std::shared_ptr<const PexFunctionIndex> GetFunctionIndex(const ScriptIdentity& identity);
 		bool GetDecompiledSource(const std::string & scriptName, std::string& decompiledSource);
+		bool GetDecompiledSource(const ScriptIdentity& identity, std::string& decompiledSource);
+		// For scripts too big to decompile whole: the declarations first, then single functions as they're needed
+		bool GetDecompiledSkeleton(const ScriptIdentity& identity, DecompiledScript& decompiled);
+		bool GetDecompiledFunction(const ScriptIdentity& identity, const std::string& objectName, const std::string& stateName, const std::string& functionName, DecompiledScript& decompiled);
+		// Decompiles the script on a background thread so a later GetDecompiledSource finds it ready
+		void QueueDecompilation(const ScriptIdentity& identity);
 		bool GetSourceData(const std::string &scriptName, dap::Source& data);
+		bool GetSourceData(const ScriptIdentity& identity, dap::Source& data);
 		void Clear();
+		// Persists debug info between runs; call before the cache is used
+		void OpenDebugInfoIndex(std::filesystem::path path);
+		void SaveDebugInfoIndex();
+		// Loose Scripts folders to map PEX files from directly, e.g. the mod being debugged
+		void SetLooseScriptDirectories(std::vector<std::filesystem::path> directories);
+		// Least recently used scripts are evicted once the estimated footprint goes over budget; 0 disables eviction
+		void SetMemoryBudget(size_t bytes);
+		// Pinned scripts (e.g. ones with breakpoints) are never evicted
+		void SetPinned(int scriptReference, bool pinned);
+		void ClearPinned();
+		PexCacheStats GetStats() const;
+		DecompiledSourceCacheStats GetDecompiledSourceStats() const { return m_decompiledSources.GetStats(); }
 	private:
-		std::mutex m_scriptsMutex;
-		std::map<int, std::shared_ptr<Pex::Binary>> m_scripts;
+		// Everything derived from a binary lives next to it, so it's dropped together with it.
+		// Published entries are never modified; adding an index publishes a copy.
+		struct CachedScript
+		{
+			std::shared_ptr<Pex::Binary> binary;
+			std::shared_ptr<const PexFunctionIndex> functionIndex;
+			size_t footprint;
+			// shared between copies of the entry, bumped on every hit
+			std::shared_ptr<std::atomic<uint64_t>> lastAccess;
+		};
+
+		// Small enough to keep for every script seen this session, so it's never evicted with the binaries
+		struct CachedDebugInfo
+		{
+			std::shared_ptr<const ScriptDebugInfo> debugInfo;
+			std::shared_ptr<const PexLineIndex> lineIndex;
+		};
+
+		using ScriptMap = std::unordered_map<int, std::shared_ptr<const CachedScript>>;
+
+		// Readers only ever load the current snapshot; writers copy the shard, modify it and swap it in
+		struct Shard
+		{
+			std::atomic<std::shared_ptr<const ScriptMap>> scripts = std::make_shared<const ScriptMap>();
+			std::mutex writeMutex;
+		};
+
+		static constexpr size_t kShardCount = 64;
+
+		std::shared_ptr<const CachedScript> FindEntry(int ref) const;
+		std::shared_ptr<const CachedDebugInfo> GetDebugInfoEntry(const ScriptIdentity& identity);
+		// Swaps in `entry` if the current one is still `expected` and the cache hasn't been cleared since `generation` was read
+		bool PublishEntry(int ref, uint64_t generation, const std::shared_ptr<const CachedScript>& expected, std::shared_ptr<const CachedScript> entry);
+		Shard& GetShard(int ref) const { return m_shards[static_cast<size_t>(ref) % kShardCount]; }
+		void Touch(const CachedScript& entry);
+		void EvictToBudget();
+
+		// Builds the index lazily on first use and caches it with the binary it was built from
+		template <typename TIndex, typename TFactory>
+		std::shared_ptr<const TIndex> GetIndex(const ScriptIdentity& identity, std::shared_ptr<const TIndex> CachedScript::* member, TFactory factory);
+
+		mutable std::array<Shard, kShardCount> m_shards;
+		// bumped by Clear so loads that started before it don't repopulate the cache
+		std::atomic<uint64_t> m_generation = 0;
+
+		// Scripts being loaded right now; later requests for the same script wait on the first load instead of parsing it again
+		std::mutex m_loadingMutex;
+		std::unordered_map<int, std::shared_future<std::shared_ptr<Pex::Binary>>> m_loading;
+
+		// compressed decompiled output, 16MB is a few hundred large scripts
+		DecompiledSourceCache m_decompiledSources{ 16 * 1024 * 1024 };
+		// like m_loading, so a request for a script the background thread is already decompiling waits for it
+		std::mutex m_decompilingMutex;
+		std::unordered_map<int, std::shared_future<std::shared_ptr<const std::string>>> m_decompiling;
+
+		std::mutex m_decompileQueueMutex;
+		std::condition_variable m_decompileQueueCondition;
+		std::deque<const ScriptIdentity*> m_decompileQueue;
+		// what's in m_decompileQueue, so queueing a script twice doesn't mean searching it
+		std::unordered_set<const ScriptIdentity*> m_decompileQueued;
+		std::thread m_decompileWorker;
+		bool m_decompileWorkerStopping = false;
+
+		std::shared_ptr<const std::string> Decompile(const ScriptIdentity& identity);
+		void DecompileWorker();
+
+		mutable std::shared_mutex m_debugInfoMutex;
+		std::unordered_map<int, std::shared_ptr<const CachedDebugInfo>> m_debugInfos;
+		std::unique_ptr<DebugInfoIndex> m_debugInfoIndex;
+
+		std::mutex m_looseScriptDirectoriesMutex;
+		std::vector<std::filesystem::path> m_looseScriptDirectories;
+
+		std::atomic<size_t> m_memoryBudget = 0;
+		std::atomic<size_t> m_footprint = 0;
+		std::atomic<uint64_t> m_accessClock = 0;
+		mutable std::atomic<uint64_t> m_hits = 0;
+		mutable std::atomic<uint64_t> m_misses = 0;
+		std::atomic<uint64_t> m_evictions = 0;
+		std::mutex m_evictionMutex;
+		mutable std::mutex m_pinnedMutex;
+		std::unordered_set<int> m_pinned;
 	};
 }
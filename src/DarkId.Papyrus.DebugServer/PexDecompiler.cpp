@@ -0,0 +1,127 @@
+#include "PexDecompiler.h"
+
+#include <regex>
+#include <sstream>
+#include <Decompiler/PscCoder.hpp>
+#include <Decompiler/StreamWriter.hpp>
+
+#include "Utilities.h"
+
+namespace DarkId::Papyrus::DebugServer
+{
+	namespace
+	{
+		// Finds each function in PscCoder's output. It always writes one declaration per line, so this doesn't need to be a parser.
+		std::vector<DecompiledFunctionRange> FindFunctionRanges(const std::string& source)
+		{
+			static const std::regex stateStart(R"(^\s*(?:auto\s+)?state\s+(\w+))", std::regex::icase);
+			static const std::regex stateEnd(R"(^\s*endstate\b)", std::regex::icase);
+			static const std::regex functionStart(R"(^\s*(?:[\w\[\]:]+\s+)?(?:function|event)\s+([\w:]+)\s*\()", std::regex::icase);
+			static const std::regex functionEnd(R"(^\s*end(?:function|event)\b)", std::regex::icase);
+			static const std::regex native(R"(\bnative\b)", std::regex::icase);
+
+			std::vector<DecompiledFunctionRange> functions;
+			std::string stateName;
+			bool inFunction = false;
+
+			std::istringstream lines(source);
+			std::string line;
+			std::smatch match;
+			for (uint32_t lineNumber = 1; std::getline(lines, line); lineNumber++)
+			{
+				if (inFunction)
+				{
+					if (std::regex_search(line, functionEnd))
+					{
+						functions.back().endLine = lineNumber;
+						inFunction = false;
+					}
+				}
+				else if (std::regex_search(line, match, functionStart))
+				{
+					functions.push_back(DecompiledFunctionRange{
+						.stateName = stateName,
+						.functionName = match[1].str(),
+						.startLine = lineNumber,
+						.endLine = lineNumber
+					});
+					// native functions are declarations only
+					inFunction = !std::regex_search(line, native);
+				}
+				else if (std::regex_search(line, match, stateStart))
+				{
+					stateName = match[1].str();
+				}
+				else if (std::regex_search(line, stateEnd))
+				{
+					stateName.clear();
+				}
+			}
+			return functions;
+		}
+	}
+
+	std::string DecompileScript(const Pex::Binary& binary)
+	{
+		std::basic_stringstream<char> pscStream;
+		Decompiler::PscCoder coder(new Decompiler::StreamWriter(pscStream));
+
+		coder.code(binary);
+
+		return std::move(pscStream).str();
+	}
+
+	DecompiledScript DecompileSkeleton(const Pex::Binary& binary)
+	{
+		// the copy's string table indices still point at the original's table, which outlives it
+		auto skeleton = binary;
+		for (auto& object : skeleton.getObjects())
+		{
+			for (auto& state : object.getStates())
+			{
+				for (auto& function : state.getFunctions())
+				{
+					function.getInstructions().clear();
+				}
+			}
+		}
+
+		DecompiledScript decompiled{ .source = DecompileScript(skeleton) };
+		decompiled.functions = FindFunctionRanges(decompiled.source);
+		return decompiled;
+	}
+
+	bool DecompileFunction(const Pex::Binary& binary, const std::string& objectName, const std::string& stateName, const std::string& functionName, DecompiledScript& decompiled)
+	{
+		auto pruned = binary;
+		bool found = false;
+		auto& objects = pruned.getObjects();
+		std::erase_if(objects, [&](const Pex::Object& object) {
+			return !CaseInsensitiveEquals(object.getName().asString(), objectName);
+		});
+		for (auto& object : objects)
+		{
+			for (auto& state : object.getStates())
+			{
+				auto& functions = state.getFunctions();
+				if (!CaseInsensitiveEquals(state.getName().asString(), stateName))
+				{
+					functions.clear();
+					continue;
+				}
+				std::erase_if(functions, [&](const Pex::Function& function) {
+					return !CaseInsensitiveEquals(function.getName().asString(), functionName);
+				});
+				found |= !functions.empty();
+			}
+		}
+		if (!found)
+		{
+			return false;
+		}
+
+		decompiled.source = DecompileScript(pruned);
+		decompiled.functions = FindFunctionRanges(decompiled.source);
+		return true;
+	}
+}
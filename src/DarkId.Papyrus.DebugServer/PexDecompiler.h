@@ -0,0 +1,32 @@
+#pragma once
+
+#include <Champollion/Pex/Binary.hpp>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace DarkId::Papyrus::DebugServer
+{
+	// Where a function ended up in decompiled output; lines are 1-based and inclusive
+	struct DecompiledFunctionRange
+	{
+		std::string stateName;
+		std::string functionName;
+		uint32_t startLine;
+		uint32_t endLine;
+	};
+
+	struct DecompiledScript
+	{
+		std::string source;
+		std::vector<DecompiledFunctionRange> functions;
+	};
+
+	// The whole script, as the source request has always returned it
+	std::string DecompileScript(const Pex::Binary& binary);
+	// Every declaration, but with empty function bodies; cheap even for huge scripts
+	DecompiledScript DecompileSkeleton(const Pex::Binary& binary);
+	// The script's declarations and just the one function; false if there's no such function
+	bool DecompileFunction(const Pex::Binary& binary, const std::string& objectName, const std::string& stateName, const std::string& functionName, DecompiledScript& decompiled);
+}
@@ -0,0 +1,106 @@
+#include "PexIndex.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+namespace DarkId::Papyrus::DebugServer
+{
+	PexLineIndex::PexLineIndex(const ScriptDebugInfo& debugInfo)
+	{
+		const auto& funcInfos = debugInfo.functions;
+
+		size_t totalLines = 0;
+		for (const auto& funcInfo : funcInfos)
+		{
+			totalLines += funcInfo.lineNumbers.size();
+		}
+		m_locations.reserve(totalLines);
+
+		std::unordered_set<uint32_t> seenLines;
+		for (size_t funcInfoIndex = 0; funcInfoIndex < funcInfos.size(); funcInfoIndex++)
+		{
+			const auto& lineNumbers = funcInfos[funcInfoIndex].lineNumbers;
+			seenLines.clear();
+			for (size_t instruction = 0; instruction < lineNumbers.size(); instruction++)
+			{
+				const auto line = static_cast<uint32_t>(lineNumbers[instruction]);
+				// a line usually spans several instructions; only the first one is a breakpoint target
+				if (seenLines.insert(line).second)
+				{
+					m_locations.push_back(Location{
+						.line = line,
+						.functionInfoIndex = static_cast<uint32_t>(funcInfoIndex),
+						.instruction = static_cast<uint32_t>(instruction)
+					});
+				}
+			}
+		}
+
+		std::sort(m_locations.begin(), m_locations.end(), [](const Location& a, const Location& b) {
+			return a.line != b.line ? a.line < b.line : a.functionInfoIndex < b.functionInfoIndex;
+		});
+		m_locations.shrink_to_fit();
+	}
+
+	std::span<const PexLineIndex::Location> PexLineIndex::GetLocations(const uint32_t line) const
+	{
+		return GetLocations(line, line);
+	}
+
+	std::span<const PexLineIndex::Location> PexLineIndex::GetLocations(const uint32_t startLine, const uint32_t endLine) const
+	{
+		if (endLine < startLine)
+		{
+			return {};
+		}
+
+		const auto first = std::lower_bound(m_locations.begin(), m_locations.end(), startLine, [](const Location& location, const uint32_t line) {
+			return location.line < line;
+		});
+		const auto last = std::upper_bound(first, m_locations.end(), endLine, [](const uint32_t line, const Location& location) {
+			return line < location.line;
+		});
+
+		return { first, last };
+	}
+
+	PexFunctionIndex::PexFunctionIndex(std::shared_ptr<Pex::Binary> binary) : m_binary(std::move(binary))
+	{
+		for (const auto& object : m_binary->getObjects())
+		{
+			for (const auto& state : object.getStates())
+			{
+				for (const auto& function : state.getFunctions())
+				{
+					m_functions.emplace(GetKey(object.getName(), state.getName(), function.getName()), std::addressof(function));
+				}
+			}
+		}
+
+		const auto& funcInfos = m_binary->getDebugInfo().getFunctionInfos();
+		m_functionsByInfoIndex.reserve(funcInfos.size());
+		for (const auto& funcInfo : funcInfos)
+		{
+			m_functionsByInfoIndex.push_back(GetFunction(funcInfo.getObjectName(), funcInfo.getStateName(), funcInfo.getFunctionName()));
+		}
+	}
+
+	uint64_t PexFunctionIndex::GetKey(const Pex::StringTable::Index& objectName, const Pex::StringTable::Index& stateName, const Pex::StringTable::Index& functionName)
+	{
+		// names within one binary are interned in its string table, so the indices identify them
+		return (static_cast<uint64_t>(objectName.getIndex()) << 32) |
+			(static_cast<uint64_t>(stateName.getIndex()) << 16) |
+			static_cast<uint64_t>(functionName.getIndex());
+	}
+
+	const Pex::Function* PexFunctionIndex::GetFunction(const Pex::StringTable::Index& objectName, const Pex::StringTable::Index& stateName, const Pex::StringTable::Index& functionName) const
+	{
+		const auto entry = m_functions.find(GetKey(objectName, stateName, functionName));
+		return entry != m_functions.end() ? entry->second : nullptr;
+	}
+
+	const Pex::Function* PexFunctionIndex::GetFunction(const size_t functionInfoIndex) const
+	{
+		return functionInfoIndex < m_functionsByInfoIndex.size() ? m_functionsByInfoIndex[functionInfoIndex] : nullptr;
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <Champollion/Pex/Binary.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#include "DebugInfoIndex.h"
+
+namespace DarkId::Papyrus::DebugServer
+{
+	// Source line -> (FunctionInfo, instruction) lookup built once from a script's debug info
+	class PexLineIndex
+	{
+	public:
+		struct Location
+		{
+			uint32_t line;
+			uint32_t functionInfoIndex;
+			// first instruction on this line within the function
+			uint32_t instruction;
+		};
+
+		explicit PexLineIndex(const ScriptDebugInfo& debugInfo);
+
+		// All functions with code on `line`, ordered by FunctionInfo index
+		std::span<const Location> GetLocations(uint32_t line) const;
+		// Locations for every line in [startLine, endLine], ordered by line
+		std::span<const Location> GetLocations(uint32_t startLine, uint32_t endLine) const;
+	private:
+		// sorted by (line, functionInfoIndex)
+		std::vector<Location> m_locations;
+	};
+
+	// (object, state, function) -> Pex::Function lookup, so nothing has to walk every object and state
+	class PexFunctionIndex
+	{
+	public:
+		explicit PexFunctionIndex(std::shared_ptr<Pex::Binary> binary);
+
+		const Pex::Function* GetFunction(const Pex::StringTable::Index& objectName, const Pex::StringTable::Index& stateName, const Pex::StringTable::Index& functionName) const;
+		// The function a debug FunctionInfo describes; nullptr for property getters and setters
+		const Pex::Function* GetFunction(size_t functionInfoIndex) const;
+		const std::shared_ptr<Pex::Binary>& GetBinary() const { return m_binary; }
+	private:
+		// keeps the functions we point into alive for as long as the index is
+		std::shared_ptr<Pex::Binary> m_binary;
+		std::unordered_map<uint64_t, const Pex::Function*> m_functions;
+		std::vector<const Pex::Function*> m_functionsByInfoIndex;
+
+		static uint64_t GetKey(const Pex::StringTable::Index& objectName, const Pex::StringTable::Index& stateName, const Pex::StringTable::Index& functionName);
+	};
+}
@@ -0,0 +1,135 @@
+#include "PexPrefetcher.h"
+
+#include <algorithm>
+
+namespace DarkId::Papyrus::DebugServer
+{
+	constexpr auto kPrefetchProgressId = "pexPrefetch";
+	constexpr auto kPrefetchProgressInterval = std::chrono::milliseconds(250);
+
+	PexPrefetcher::~PexPrefetcher()
+	{
+		Cancel();
+	}
+
+	void PexPrefetcher::Start(std::vector<const ScriptIdentity*> scripts, const size_t binaryCount, std::shared_ptr<dap::Session> session)
+	{
+		Cancel();
+		if (scripts.empty())
+		{
+			return;
+		}
+
+		m_scripts = std::move(scripts);
+		m_binaryCount = std::min(binaryCount, m_scripts.size());
+		m_session = std::move(session);
+		m_cancelled = false;
+		m_nextScript = 0;
+		m_loadedScripts = 0;
+		m_startedAt = m_lastProgressUpdate = std::chrono::steady_clock::now();
+
+		if (m_session)
+		{
+			m_session->send(dap::ProgressStartEvent{
+				.cancellable = false,
+				.message = std::format("0 of {} scripts", m_scripts.size()),
+				.percentage = dap::number(0),
+				.progressId = kPrefetchProgressId,
+				.title = "Loading scripts"
+			});
+		}
+
+		// parsing is CPU bound, but leave most of the cores to the game
+		const auto workerCount = std::clamp<size_t>(std::thread::hardware_concurrency() / 2, 1, 4);
+		m_activeWorkers = workerCount;
+		for (size_t i = 0; i < workerCount; i++)
+		{
+			m_workers.emplace_back(&PexPrefetcher::Work, this);
+		}
+
+		logger::info("Prefetching {} scripts ({} in full) on {} threads", m_scripts.size(), m_binaryCount, workerCount);
+	}
+
+	void PexPrefetcher::Cancel()
+	{
+		m_cancelled = true;
+		for (auto& worker : m_workers)
+		{
+			if (worker.joinable())
+			{
+				worker.join();
+			}
+		}
+		m_workers.clear();
+		m_scripts.clear();
+		m_session = nullptr;
+	}
+
+	void PexPrefetcher::Work()
+	{
+		while (!m_cancelled)
+		{
+			const auto index = m_nextScript.fetch_add(1);
+			if (index >= m_scripts.size())
+			{
+				break;
+			}
+
+			if (index < m_binaryCount)
+			{
+				m_pexCache->GetScript(*m_scripts[index]);
+			}
+			else
+			{
+				m_pexCache->GetDebugInfo(*m_scripts[index]);
+			}
+			m_loadedScripts++;
+			ReportProgress();
+		}
+
+		// the last worker out reports the end
+		if (m_activeWorkers.fetch_sub(1) == 1)
+		{
+			ReportFinished();
+		}
+	}
+
+	void PexPrefetcher::ReportProgress()
+	{
+		if (!m_session)
+		{
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(m_progressMutex, std::try_to_lock);
+		const auto now = std::chrono::steady_clock::now();
+		if (!lock.owns_lock() || now - m_lastProgressUpdate < kPrefetchProgressInterval)
+		{
+			return;
+		}
+		m_lastProgressUpdate = now;
+
+		const auto loaded = m_loadedScripts.load();
+		m_session->send(dap::ProgressUpdateEvent{
+			.message = std::format("{} of {} scripts", loaded, m_scripts.size()),
+			.percentage = dap::number(100.0 * static_cast<double>(loaded) / static_cast<double>(m_scripts.size())),
+			.progressId = kPrefetchProgressId
+		});
+	}
+
+	void PexPrefetcher::ReportFinished()
+	{
+		const auto loaded = m_loadedScripts.load();
+		const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_startedAt);
+		logger::info("Prefetched {} of {} scripts in {}ms{}", loaded, m_scripts.size(), elapsed.count(), m_cancelled ? " (cancelled)" : "");
+
+		if (m_session)
+		{
+			std::lock_guard<std::mutex> lock(m_progressMutex);
+			m_session->send(dap::ProgressEndEvent{
+				.message = std::format("Loaded {} scripts", loaded),
+				.progressId = kPrefetchProgressId
+			});
+		}
+	}
+}
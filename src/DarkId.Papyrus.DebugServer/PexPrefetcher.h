@@ -0,0 +1,49 @@
+#pragma once
+
+#include "PexCache.h"
+#include "ScriptIdentityCache.h"
+
+#include <atomic>
+#include <chrono>
+#include <dap/session.h>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace DarkId::Papyrus::DebugServer
+{
+	// Parses scripts into the PexCache on a few worker threads, so the first requests after attaching don't have to
+	class PexPrefetcher
+	{
+	public:
+		explicit PexPrefetcher(PexCache* pexCache) : m_pexCache(pexCache)
+		{
+		}
+		~PexPrefetcher();
+
+		// Scripts are loaded roughly in the order given; the first `binaryCount` are parsed in full, the rest only
+		// have their debug info read, so they don't compete with the project for the cache's memory budget.
+		// Progress is only reported when `session` is set
+		void Start(std::vector<const ScriptIdentity*> scripts, size_t binaryCount, std::shared_ptr<dap::Session> session);
+		void Cancel();
+	private:
+		PexCache* m_pexCache;
+		std::vector<const ScriptIdentity*> m_scripts;
+		size_t m_binaryCount = 0;
+		std::shared_ptr<dap::Session> m_session;
+		std::vector<std::thread> m_workers;
+
+		std::atomic<bool> m_cancelled = false;
+		std::atomic<size_t> m_nextScript = 0;
+		std::atomic<size_t> m_loadedScripts = 0;
+		std::atomic<size_t> m_activeWorkers = 0;
+		std::chrono::steady_clock::time_point m_startedAt;
+
+		std::mutex m_progressMutex;
+		std::chrono::steady_clock::time_point m_lastProgressUpdate;
+
+		void Work();
+		void ReportProgress();
+		void ReportFinished();
+	};
+}
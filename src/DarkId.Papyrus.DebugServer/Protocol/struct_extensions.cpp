@@ -10,7 +10,12 @@ namespace dap {
         DAP_FIELD(game, "game"),
         DAP_FIELD(projectPath, "projectPath"),
         DAP_FIELD(modDirectory, "modDirectory"),
-        DAP_FIELD(projectSources, "projectSources")
+        DAP_FIELD(projectSources, "projectSources"),
+        DAP_FIELD(pexCacheBudget, "pexCacheBudget"),
+        DAP_FIELD(prefetchScripts, "prefetchScripts"),
+        DAP_FIELD(threadEventWindow, "threadEventWindow"),
+        DAP_FIELD(threadEventSummary, "threadEventSummary"),
+        DAP_FIELD(snapshotOnPause, "snapshotOnPause")
     );
     DAP_IMPLEMENT_STRUCT_TYPEINFO_EXT(PDSLaunchRequest,
         LaunchRequest,
@@ -21,6 +26,57 @@ namespace dap {
         DAP_FIELD(game, "game"),
         DAP_FIELD(projectPath, "projectPath"),
         DAP_FIELD(modDirectory, "modDirectory"),
-        DAP_FIELD(projectSources, "projectSources")
+        DAP_FIELD(projectSources, "projectSources"),
+        DAP_FIELD(pexCacheBudget, "pexCacheBudget"),
+        DAP_FIELD(prefetchScripts, "prefetchScripts"),
+        DAP_FIELD(threadEventWindow, "threadEventWindow"),
+        DAP_FIELD(threadEventSummary, "threadEventSummary"),
+        DAP_FIELD(snapshotOnPause, "snapshotOnPause")
     );
-}
\ No newline at end of file
+    DAP_IMPLEMENT_STRUCT_TYPEINFO(PDSDebuggerStatsRequest,
+        "pdsDebuggerStats"
+    );
+    DAP_IMPLEMENT_STRUCT_TYPEINFO(PDSDebuggerStatsResponse,
+        "",
+        DAP_FIELD(resumeLatencySampleCount, "resumeLatencySampleCount"),
+        DAP_FIELD(resumeLatencyP50, "resumeLatencyP50"),
+        DAP_FIELD(resumeLatencyP90, "resumeLatencyP90"),
+        DAP_FIELD(resumeLatencyP99, "resumeLatencyP99"),
+        DAP_FIELD(resumeLatencyMax, "resumeLatencyMax"),
+        DAP_FIELD(instructionHookArmed, "instructionHookArmed"),
+        DAP_FIELD(instructionHookArmCount, "instructionHookArmCount"),
+        DAP_FIELD(instructionHookArmedTime, "instructionHookArmedTime"),
+        DAP_FIELD(pexCacheHits, "pexCacheHits"),
+        DAP_FIELD(pexCacheMisses, "pexCacheMisses"),
+        DAP_FIELD(pexCacheEvictions, "pexCacheEvictions"),
+        DAP_FIELD(pexCacheScripts, "pexCacheScripts"),
+        DAP_FIELD(pexCacheFootprint, "pexCacheFootprint"),
+        DAP_FIELD(pexCacheBudget, "pexCacheBudget")
+    );
+    DAP_IMPLEMENT_STRUCT_TYPEINFO(PDSDecompiledFunction,
+        "",
+        DAP_FIELD(stateName, "stateName"),
+        DAP_FIELD(functionName, "functionName"),
+        DAP_FIELD(startLine, "startLine"),
+        DAP_FIELD(endLine, "endLine")
+    );
+    DAP_IMPLEMENT_STRUCT_TYPEINFO(PDSDecompiledSourceRequest,
+        "pdsDecompiledSource",
+        DAP_FIELD(source, "source"),
+        DAP_FIELD(objectName, "objectName"),
+        DAP_FIELD(stateName, "stateName"),
+        DAP_FIELD(functionName, "functionName")
+    );
+    DAP_IMPLEMENT_STRUCT_TYPEINFO(PDSDecompiledSourceResponse,
+        "",
+        DAP_FIELD(content, "content"),
+        DAP_FIELD(functions, "functions")
+    );
+    DAP_IMPLEMENT_STRUCT_TYPEINFO(PDSThreadSummaryEvent,
+        "pdsThreadSummary",
+        DAP_FIELD(started, "started"),
+        DAP_FIELD(exited, "exited"),
+        DAP_FIELD(coalesced, "coalesced"),
+        DAP_FIELD(running, "running")
+    );
+}
@@ -17,6 +17,16 @@ namespace dap{
     optional<string> projectPath;
     optional<string> modDirectory;
     optional<array<Source>> projectSources;
+    // Memory budget for parsed PEX files, in megabytes; unlimited when omitted
+    optional<integer> pexCacheBudget;
+    // Parse the project's and the VM's scripts in the background right after attaching
+    optional<boolean> prefetchScripts;
+    // Stacks that exit within this many milliseconds of starting aren't reported as threads
+    optional<integer> threadEventWindow;
+    // Report pdsThreadSummary counts instead of individual thread events
+    optional<boolean> threadEventSummary;
+    // Capture the stopped stack's frames and variables when it stops, instead of reading them from the VM per request
+    optional<boolean> snapshotOnPause;
   };
 
   struct PDSLaunchRequest : public LaunchRequest {
@@ -28,12 +38,80 @@ namespace dap{
       optional<string> projectPath;
       optional<string> modDirectory;
       optional<array<Source>> projectSources;
+      optional<integer> pexCacheBudget;
+      optional<boolean> prefetchScripts;
+      optional<integer> threadEventWindow;
+      optional<boolean> threadEventSummary;
+      optional<boolean> snapshotOnPause;
       optional<object> mo2Config;
       optional<string> XSELoaderPath;
       optional<array<string>> args;
   };
 
+  // Custom request for debugger performance counters; all durations are in microseconds
+
+  struct PDSDebuggerStatsResponse : public Response {
+    integer resumeLatencySampleCount = 0;
+    number resumeLatencyP50 = 0;
+    number resumeLatencyP90 = 0;
+    number resumeLatencyP99 = 0;
+    number resumeLatencyMax = 0;
+    boolean instructionHookArmed = false;
+    integer instructionHookArmCount = 0;
+    number instructionHookArmedTime = 0;
+    integer pexCacheHits = 0;
+    integer pexCacheMisses = 0;
+    integer pexCacheEvictions = 0;
+    integer pexCacheScripts = 0;
+    // bytes
+    integer pexCacheFootprint = 0;
+    integer pexCacheBudget = 0;
+  };
+
+  struct PDSDebuggerStatsRequest : public Request {
+    using Response = PDSDebuggerStatsResponse;
+  };
+
+  // Custom request for decompiling large scripts piecemeal: without a function it returns the script with empty
+  // function bodies, with one it returns the script's declarations and just that function
+
+  struct PDSDecompiledFunction {
+    string stateName;
+    string functionName;
+    // 1-based, inclusive, within the returned content
+    integer startLine;
+    integer endLine;
+  };
+
+  struct PDSDecompiledSourceResponse : public Response {
+    string content;
+    array<PDSDecompiledFunction> functions;
+  };
+
+  struct PDSDecompiledSourceRequest : public Request {
+    using Response = PDSDecompiledSourceResponse;
+    Source source;
+    optional<string> objectName;
+    optional<string> stateName;
+    optional<string> functionName;
+  };
+
+  // Sent instead of thread events when threadEventSummary is set; counts are since the previous summary
+
+  struct PDSThreadSummaryEvent : public Event {
+    integer started;
+    integer exited;
+    integer coalesced;
+    integer running;
+  };
+
   DAP_DECLARE_STRUCT_TYPEINFO(PDSAttachRequest);
   DAP_DECLARE_STRUCT_TYPEINFO(PDSLaunchRequest);
+  DAP_DECLARE_STRUCT_TYPEINFO(PDSDebuggerStatsRequest);
+  DAP_DECLARE_STRUCT_TYPEINFO(PDSDebuggerStatsResponse);
+  DAP_DECLARE_STRUCT_TYPEINFO(PDSDecompiledFunction);
+  DAP_DECLARE_STRUCT_TYPEINFO(PDSDecompiledSourceRequest);
+  DAP_DECLARE_STRUCT_TYPEINFO(PDSDecompiledSourceResponse);
+  DAP_DECLARE_STRUCT_TYPEINFO(PDSThreadSummaryEvent);
 
 }
@@ -1,13 +1,19 @@
 #include "pdsPCH.h"
 #include "websocket_reader_writer.h"
 
+#include <algorithm>
+#include <cstring>
+
+namespace {
+    constexpr char kContentLengthHeader[] = "Content-Length";
+}
+
 void dap::WebsocketReaderWriter::HandleMessage(websocketpp::connection_hdl hdl, message_ptr msg) {
+    // cppdap expects a Content-Length framed stream; the payload itself is taken over rather than copied
+    auto header = "Content-Length: " + std::to_string(msg->get_payload().length()) + "\r\n\r\n";
     std::unique_lock<std::mutex> lock(readMutex);
-    std::string str = "Content-Length: " + std::to_string(msg->get_payload().length()) + "\r\n\r\n" + msg->get_payload();
-    for (auto c : str) {
-        buf.push_back(c);
-    }
-    ready = true;
+    chunks.push_back(Chunk{ std::move(header) });
+    chunks.push_back(Chunk{ std::move(msg->get_raw_payload()) });
     cv.notify_one();
 }
 
@@ -24,20 +30,20 @@ size_t dap::WebsocketReaderWriter::read(void* buffer, size_t n) {
     size_t bytes_read = 0;
     auto out = reinterpret_cast<char*>(buffer);
 
-    while (isOpen() && buf.size() == 0) {
-        cv.wait(lock, [&] {return ready; });
-    }
+    cv.wait(lock, [&] { return !chunks.empty() || closed || !isOpen(); });
     // might have closed while waiting
     if (!isOpen()) {
         return bytes_read;
     }
-    for (; bytes_read < n && buf.size() > 0; bytes_read++) {
-        out[bytes_read] = buf.front();
-        buf.pop_front();
-    }
-    if (buf.size() == 0)
-    {
-        ready = false;
+    while (bytes_read < n && !chunks.empty()) {
+        auto& chunk = chunks.front();
+        const auto count = std::min(n - bytes_read, chunk.data.size() - chunk.offset);
+        std::memcpy(out + bytes_read, chunk.data.data() + chunk.offset, count);
+        bytes_read += count;
+        chunk.offset += count;
+        if (chunk.offset == chunk.data.size()) {
+            chunks.pop_front();
+        }
     }
     return bytes_read;
 }
@@ -47,12 +53,12 @@ bool dap::WebsocketReaderWriter::write(const void* buffer, size_t n) {
     if (!isOpen()) {
         return false;
     }
-    std::string str((char*)buffer, n);
-    // Header, disregard
-    if (str.find("Content-Length") == 0) {
+    // Header, disregard; each websocket message is already one DAP message
+    constexpr auto headerLength = sizeof(kContentLengthHeader) - 1;
+    if (n >= headerLength && std::memcmp(buffer, kContentLengthHeader, headerLength) == 0) {
         return true;
     }
-    return con->send(str) == websocketpp::lib::error_code();
+    return con->send(buffer, n, websocketpp::frame::opcode::text) == websocketpp::lib::error_code();
 }
 
 bool dap::WebsocketReaderWriter::isOpen() {
@@ -72,6 +78,6 @@ void dap::WebsocketReaderWriter::close() {
             }
         }
     }
-    ready = true;
+    closed = true;
     cv.notify_all();
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <deque>
 #include <string>
 #include <dap/io.h>
 #include "websocket_impl.h"
@@ -19,11 +20,16 @@ class WebsocketReaderWriter : public ReaderWriter {
 
     virtual void close() override;
   private:
+    // A piece of the incoming stream: a Content-Length header or a message payload, handed to read() as-is
+    struct Chunk {
+      std::string data;
+      size_t offset = 0;
+    };
+
     void HandleMessage(websocketpp::connection_hdl hdl, message_ptr msg);
 
     std::shared_ptr<connection> con;
-    std::deque<uint8_t> buf;
-    bool ready = false;
+    std::deque<Chunk> chunks;
     std::mutex readMutex;
     std::condition_variable cv;
     std::mutex writeMutex;
@@ -13,6 +13,8 @@
 #include <F4SE/Trampoline.h>
 #endif
 
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <mutex>
 #include <dap/protocol.h>
@@ -70,6 +72,159 @@ namespace DarkId::Papyrus::DebugServer
 			#endif
 
 		};
+		// A 6-byte branch that can be written into and removed from the game's code on demand
+		class OnDemandBranch
+		{
+		public:
+			using Bytes = std::array<std::uint8_t, 6>;
+
+			// Writes the branch once to learn its encoding, then puts the original bytes back if it can be removed again.
+			// This runs before any scripts do, so the write itself doesn't have to be atomic.
+			//
+			// singleInstruction says the six bytes being replaced are exactly one instruction. Only then is no thread
+			// ever part-way through them, so only then is swapping them while scripts run safe; a site that covers
+			// several instructions could be resumed in the middle, so its branch stays installed for good.
+			template <class WriteBranch>
+			void Capture(const std::uintptr_t address, const bool singleInstruction, WriteBranch writeBranch)
+			{
+				m_address = address;
+				std::memcpy(m_originalBytes.data(), reinterpret_cast<const void*>(address), m_originalBytes.size());
+				writeBranch();
+				std::memcpy(m_branchBytes.data(), reinterpret_cast<const void*>(address), m_branchBytes.size());
+
+				// and the swap itself has to be a single atomic store, so the patch can't straddle a qword
+				const auto aligned = m_address & ~static_cast<std::uintptr_t>(7);
+				const bool fitsInQword = m_address + m_branchBytes.size() <= aligned + 8;
+				m_onDemand = singleInstruction && fitsInQword;
+				if (m_onDemand)
+				{
+					Write(m_originalBytes);
+				}
+				else if (!singleInstruction)
+				{
+					logger::info("Branch at 0x{:X} replaces more than one instruction; leaving it installed", m_address);
+				}
+				else
+				{
+					logger::warn("Branch at 0x{:X} straddles a qword boundary and can't be patched atomically; leaving it installed", m_address);
+				}
+			}
+
+			bool IsCaptured() const { return m_address != 0; }
+			bool IsOnDemand() const { return m_onDemand; }
+
+			void Apply(const bool armed)
+			{
+				if (m_onDemand)
+				{
+					Write(armed ? m_branchBytes : m_originalBytes);
+				}
+			}
+		private:
+			void Write(const Bytes& bytes) const
+			{
+				// Capture only gets here for a single instruction inside one qword, so a script thread racing through
+				// the site fetches either the whole original instruction or the whole branch
+				const auto aligned = m_address & ~static_cast<std::uintptr_t>(7);
+				DWORD oldProtect;
+				VirtualProtect(reinterpret_cast<void*>(aligned), 8, PAGE_EXECUTE_READWRITE, &oldProtect);
+				const auto qword = reinterpret_cast<volatile LONG64*>(aligned);
+				LONG64 expected;
+				LONG64 desired;
+				do
+				{
+					expected = *qword;
+					desired = expected;
+					std::memcpy(reinterpret_cast<std::uint8_t*>(&desired) + (m_address - aligned), bytes.data(), bytes.size());
+				} while (InterlockedCompareExchange64(qword, desired, expected) != expected);
+				VirtualProtect(reinterpret_cast<void*>(aligned), 8, oldProtect, &oldProtect);
+				FlushInstructionCache(GetCurrentProcess(), reinterpret_cast<void*>(aligned), 8);
+			}
+
+			std::uintptr_t m_address = 0;
+			bool m_onDemand = false;
+			Bytes m_originalBytes{};
+			Bytes m_branchBytes{};
+		};
+
+		OnDemandBranch g_instructionHookBranch;
+		std::mutex g_instructionHookMutex;
+		std::atomic<bool> g_instructionHookWanted = false;
+		bool g_instructionHookApplied = false;
+		bool g_instructionHookApplyQueued = false;
+		std::chrono::steady_clock::time_point g_instructionHookArmedAt;
+		std::chrono::nanoseconds g_instructionHookTotalArmedTime{ 0 };
+		uint32_t g_instructionHookArmCount = 0;
+
+		void ApplyInstructionHookArmed()
+		{
+			std::lock_guard<std::mutex> lock(g_instructionHookMutex);
+			g_instructionHookApplyQueued = false;
+
+			const bool wanted = g_instructionHookWanted;
+			// a branch that couldn't be made removable is always in place; the armed state alone gates the handlers
+			if (wanted == g_instructionHookApplied || !g_instructionHookBranch.IsCaptured() || !g_instructionHookBranch.IsOnDemand())
+			{
+				return;
+			}
+
+			g_instructionHookBranch.Apply(wanted);
+			g_instructionHookApplied = wanted;
+
+			const auto now = std::chrono::steady_clock::now();
+			if (wanted)
+			{
+				g_instructionHookArmedAt = now;
+				g_instructionHookArmCount++;
+				logger::info("Instruction hook armed");
+			}
+			else
+			{
+				const auto armedTime = now - g_instructionHookArmedAt;
+				g_instructionHookTotalArmedTime += armedTime;
+				logger::info("Instruction hook disarmed after {}ms (armed {} times, {}ms in total)",
+					std::chrono::duration_cast<std::chrono::milliseconds>(armedTime).count(),
+					g_instructionHookArmCount,
+					std::chrono::duration_cast<std::chrono::milliseconds>(g_instructionHookTotalArmedTime).count());
+			}
+		}
+
+		void SetInstructionHookArmed(const bool armed)
+		{
+			if (g_instructionHookWanted.exchange(armed) == armed)
+			{
+				return;
+			}
+
+			std::lock_guard<std::mutex> lock(g_instructionHookMutex);
+			if (g_instructionHookApplyQueued)
+			{
+				return;
+			}
+			g_instructionHookApplyQueued = true;
+
+			// Patch from the game's task queue, which runs between VM updates rather than in the middle of a tasklet
+			XSE::GetTaskInterface()->AddTask([]() {
+				ApplyInstructionHookArmed();
+			});
+		}
+
+		InstructionHookStats GetInstructionHookStats()
+		{
+			std::lock_guard<std::mutex> lock(g_instructionHookMutex);
+			auto totalArmedTime = g_instructionHookTotalArmedTime;
+			if (g_instructionHookApplied)
+			{
+				totalArmedTime += std::chrono::steady_clock::now() - g_instructionHookArmedAt;
+			}
+
+			return InstructionHookStats{
+				.armed = g_instructionHookApplied || (g_instructionHookBranch.IsCaptured() && !g_instructionHookBranch.IsOnDemand()),
+				.armCount = g_instructionHookArmCount,
+				.totalArmedTime = totalArmedTime
+			};
+		}
+
 		struct CallPatch : Xbyak::CodeGenerator
 		{
 		protected:
@@ -386,7 +541,11 @@ namespace DarkId::Papyrus::DebugServer
 					auto& trampoline = SKSE::GetTrampoline();
 					SKSE::AllocTrampoline(patch.getSize() + 14);
 					auto result = trampoline.allocate(patch);
-					trampoline.write_branch<6>(cave_start_reloc.address(), (std::uintptr_t)result);
+					// Only capture the branch here; it gets written when a debug session arms the hook.
+					// The six bytes are the whole `jz`, so the branch can come and go with the session.
+					g_instructionHookBranch.Capture(cave_start_reloc.address(), true, [&]() {
+						trampoline.write_branch<6>(cave_start_reloc.address(), (std::uintptr_t)result);
+					});
 					auto BASE_LOAD_ADDR = vmprocess_reloc.address() - vmprocess_reloc.offset();
 					logger::info("Base for executable is: 0x{:X}", BASE_LOAD_ADDR);
 					logger::info("InstructionExecute address: 0x{:X}", vmprocess_reloc.address());
@@ -523,7 +682,7 @@ namespace DarkId::Papyrus::DebugServer
 			if (tasklet->topFrame)
 			{
 				// We don't need to set the instruction pointer because Fallout 4 assigns the IP every time an opcode is executed
-				g_InstructionExecutionEvent(tasklet, tasklet->topFrame->STACK_FRAME_IP);
+				g_InstructionExecutionEvent(tasklet);
 			}
 		}
 		// TODO: There's a second CreateStack() @ 1427422C0, do we need to hook that?
@@ -614,7 +773,11 @@ namespace DarkId::Papyrus::DebugServer
 					auto& trampoline = XSE::GetTrampoline();
 					XSE::AllocTrampoline(patch.getSize() + 14);
 					auto result = trampoline.allocate(patch);
-					trampoline.write_branch<6>(InstructionExecute.address(), (std::uintptr_t)result);
+					// The six bytes are two instructions (`and edx, 0x3F; and eax, 0x3F`), and a thread could be between
+					// them when the branch lands, so this one stays installed and the armed word gates the handler
+					g_instructionHookBranch.Capture(InstructionExecute.address(), false, [&]() {
+						trampoline.write_branch<6>(InstructionExecute.address(), (std::uintptr_t)result);
+					});
 
 					// void* codeBuf = g_localTrampoline.StartAlloc();
 					// InstructionExecute_Code code(codeBuf, (uintptr_t)InstructionExecute_Hook);
@@ -1,4 +1,5 @@
 #pragma once
+#include <chrono>
 #include <functional>
 
 #include <dap/protocol.h>
@@ -26,6 +27,18 @@ namespace DarkId::Papyrus::DebugServer
 
         // TODO: Refactor this
         void EmitBreakpointChangedEvent(const dap::Breakpoint &bpoint, const std::string& what);
+
+        struct InstructionHookStats
+        {
+            bool armed;
+            uint32_t armCount;
+            std::chrono::nanoseconds totalArmedTime;
+        };
+
+        // The instruction hook is only patched into CodeTasklet::VMProcess while something (breakpoints, step, pause) needs it;
+        // otherwise the original instruction bytes are in place and the VM runs at full speed.
+        void SetInstructionHookArmed(bool armed);
+        InstructionHookStats GetInstructionHookStats();
         namespace Internal
         {
             void CommitHooks();
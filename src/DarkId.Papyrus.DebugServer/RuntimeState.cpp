@@ -1,8 +1,11 @@
 #include "RuntimeState.h"
+#include <algorithm>
 #include "Utilities.h"
+#include "PexCache.h"
 #include "StateNodeBase.h"
 
 #include "StackStateNode.h"
+#include "StackFrameStateNode.h"
 #include "ObjectStateNode.h"
 
 #include "ArrayStateNode.h"
@@ -20,9 +23,67 @@ namespace DarkId::Papyrus::DebugServer
 {
 	using namespace RE::BSScript::Internal;
 
-	RuntimeState::RuntimeState(const std::shared_ptr<IdProvider>& idProvider)
+	namespace
 	{
-		m_paths = std::make_unique<IdMap<std::string>>(idProvider);
+		bool SerializeNode(StateNodeBase* node, const ScriptIdentity*& pendingSource, dap::StackFrame& stackFrame)
+		{
+			const auto frameNode = dynamic_cast<StackFrameStateNode*>(node);
+			return frameNode && frameNode->SerializeToProtocol(stackFrame, pendingSource);
+		}
+
+		bool SerializeNode(StateNodeBase* node, const ScriptIdentity*&, dap::Scope& scope)
+		{
+			const auto serializable = dynamic_cast<IProtocolScopeSerializable*>(node);
+			return serializable && serializable->SerializeToProtocol(scope);
+		}
+
+		bool SerializeNode(StateNodeBase* node, const ScriptIdentity*&, dap::Variable& variable)
+		{
+			const auto serializable = dynamic_cast<IProtocolVariableSerializable*>(node);
+			return serializable && serializable->SerializeToProtocol(variable);
+		}
+	}
+
+	RuntimeState::RuntimeState(const std::shared_ptr<IdProvider>& idProvider) : m_idProvider(idProvider)
+	{
+		m_handles.emplace(&m_arena);
+		m_pathHandles.emplace(&m_arena);
+	}
+
+	void RuntimeState::InvalidateHandles()
+	{
+		std::lock_guard lock(m_handlesMutex);
+		m_idProvider->NextGeneration();
+
+		m_handles.reset();
+		m_pathHandles.reset();
+		m_threads.reset();
+		m_arena.release();
+		m_handles.emplace(&m_arena);
+		m_pathHandles.emplace(&m_arena);
+	}
+
+	void RuntimeState::InvalidateStackHandles(const uint32_t stackId)
+	{
+		std::lock_guard lock(m_handlesMutex);
+		// the entries' memory stays in the arena until the next full invalidation
+		std::erase_if(*m_handles, [stackId](const auto& handle) { return handle.second.stackId == stackId; });
+		std::erase_if(*m_pathHandles, [this](const auto& pathHandle) { return !m_handles->contains(pathHandle.second); });
+		// the stack may be gone by the time anyone asks again
+		m_threads.reset();
+	}
+
+	bool RuntimeState::IsStale(const uint32_t id) const
+	{
+		return !m_idProvider->IsCurrent(id);
+	}
+
+	uint32_t RuntimeState::AddHandle(const std::shared_ptr<StateNodeBase>& node, const uint32_t stackId)
+	{
+		const auto id = m_idProvider->GetNext();
+		node->SetId(id);
+		m_handles->emplace(id, Handle{ .node = node, .stackId = stackId });
+		return id;
 	}
 
 	bool RuntimeState::ResolveStateByPath(const std::string requestedPath, std::shared_ptr<StateNodeBase>& node)
@@ -36,126 +97,508 @@ namespace DarkId::Papyrus::DebugServer
 			return false;
 		}
 
-		const auto stackIdElement = elements.at(0);
 		int stackId;
-		if (!ParseInt(stackIdElement, &stackId))
+		if (!ParseInt(elements.at(0), &stackId))
 		{
 			return false;
 		}
 
-		std::vector<std::string> currentPathElements;
-		currentPathElements.push_back(stackIdElement);
-
-		elements.erase(elements.begin());
+		std::lock_guard lock(m_handlesMutex);
+		const auto existing = m_pathHandles->find(std::pmr::string(path));
+		if (existing != m_pathHandles->end())
+		{
+			node = m_handles->at(existing->second).node;
+			return true;
+		}
 
 		std::shared_ptr<StateNodeBase> currentNode = std::make_shared<StackStateNode>(stackId);
+		for (size_t i = 1; i < elements.size() && currentNode; i++)
+		{
+			const auto structured = dynamic_cast<IStructuredState*>(currentNode.get());
+			if (structured && !structured->GetChildNode(elements.at(i), currentNode))
+			{
+				currentNode = nullptr;
+			}
+		}
+
+		if (!currentNode)
+		{
+			return false;
+		}
 
-		while (!elements.empty() && currentNode)
+		node = currentNode;
+		const auto id = AddHandle(node, static_cast<uint32_t>(stackId));
+		m_pathHandles->emplace(path, id);
+		if (elements.size() == 1)
+		{
+			// a stack is known to the client by its thread id
+			node->SetId(stackId);
+		}
+
+		return true;
+	}
+
+	const std::pmr::vector<uint32_t>* RuntimeState::MaterializeChildren(const uint32_t id)
+	{
+		const auto handle = m_handles->find(id);
+		if (handle == m_handles->end())
 		{
-			auto structured = dynamic_cast<IStructuredState*>(currentNode.get());
-			
-			if (structured)
+			return nullptr;
+		}
+
+		if (!handle->second.children)
+		{
+			const auto structured = dynamic_cast<IStructuredState*>(handle->second.node.get());
+			if (!structured)
 			{
-				std::vector<std::string> childNames;
-				structured->GetChildNames(childNames);
+				return nullptr;
+			}
+
+			std::vector<std::string> childNames;
+			structured->GetChildNames(childNames);
 
-				for (auto childName : childNames)
+			const auto stackId = handle->second.stackId;
+			std::pmr::vector<uint32_t> children(&m_arena);
+			children.reserve(childNames.size());
+			for (const auto& childName : childNames)
+			{
+				std::shared_ptr<StateNodeBase> childNode;
+				if (structured->GetChildNode(childName, childNode) && childNode)
 				{
-					ToLower(childName);
-					auto discoveredElements(currentPathElements);
-					discoveredElements.push_back(childName);
+					children.push_back(AddHandle(childNode, stackId));
+				}
+			}
+			// AddHandle may have rehashed the table
+			m_handles->at(id).children = std::move(children);
+		}
 
-					const auto discoveredPath = Join(discoveredElements, ".");
+		return &*m_handles->at(id).children;
+	}
 
-					uint32_t addedId;
-					m_paths->AddOrGetExisting(discoveredPath, addedId);
-				}
+	bool RuntimeState::ResolvePathHandle(const std::string& requestedPath, uint32_t& id)
+	{
+		std::shared_ptr<StateNodeBase> resolved;
+		if (!ResolveStateByPath(requestedPath, resolved))
+		{
+			return false;
+		}
+
+		id = m_pathHandles->at(std::pmr::string(ToLowerCopy(requestedPath)));
+		return true;
+	}
+
+	bool RuntimeState::SerializeThreads(std::vector<dap::Thread>& threads)
+	{
+		const auto vm = VirtualMachine::GetSingleton();
+		for (auto& elem : vm->allRunningStacks)
+		{
+			const auto stack = elem.second.get();
+			if (!stack || !stack->top)
+			{
+				continue;
 			}
-			
-			const auto currentName = elements.at(0);
-			currentPathElements.push_back(currentName);
-		
-			if (structured && !structured->GetChildNode(currentName, currentNode))
+
+			std::shared_ptr<StateNodeBase> stateNode;
+			if (!ResolveStateByPath(std::to_string(stack->stackID), stateNode))
 			{
-				currentNode = nullptr;
-				break;
+				continue;
+			}
+
+			dap::Thread thread;
+			if (dynamic_cast<StackStateNode*>(stateNode.get())->SerializeToProtocol(thread))
+			{
+				threads.push_back(thread);
 			}
-		
-			elements.erase(elements.begin());
 		}
+		return true;
+	}
 
-		if (!currentNode)
+	bool RuntimeState::GetThreads(std::vector<dap::Thread>& threads)
+	{
+		{
+			std::lock_guard lock(m_handlesMutex);
+			if (m_threads)
+			{
+				threads = *m_threads;
+				return true;
+			}
+		}
+
+		// the stacks come and go while the VM runs, so this isn't kept
+		const auto vm = VirtualMachine::GetSingleton();
+		RE::BSSpinLockGuard vmLock(vm->runningStacksLock);
+		std::lock_guard lock(m_handlesMutex);
+		return SerializeThreads(threads);
+	}
+
+	template <typename T>
+	bool RuntimeState::SerializeChildren(const uint32_t id)
+	{
+		const auto children = MaterializeChildren(id);
+		if (!children)
 		{
 			return false;
 		}
 
-		node = currentNode;
+		for (const auto childId : *children)
+		{
+			auto& child = m_handles->at(childId);
+			if (child.serialized)
+			{
+				continue;
+			}
 
-		if (currentPathElements.size() > 1)
+			T item;
+			if (SerializeNode(child.node.get(), child.pendingSource, item))
+			{
+				child.protocol = std::move(item);
+			}
+			child.serialized = true;
+		}
+		return true;
+	}
+
+	void RuntimeState::ResolvePendingSources(const uint32_t id, PexCache* pexCache)
+	{
+		std::vector<std::pair<uint32_t, const ScriptIdentity*>> pending;
 		{
-			uint32_t id;
-			m_paths->AddOrGetExisting(path, id);
-			node->SetId(id);
+			std::lock_guard lock(m_handlesMutex);
+			const auto handle = m_handles->find(id);
+			if (handle == m_handles->end() || !handle->second.children)
+			{
+				return;
+			}
+
+			for (const auto childId : *handle->second.children)
+			{
+				if (const auto script = m_handles->at(childId).pendingSource)
+				{
+					pending.emplace_back(childId, script);
+				}
+			}
 		}
-		else
+		if (pending.empty())
 		{
-			node->SetId(stackId);
+			return;
+		}
+
+		std::vector<std::optional<dap::Source>> sources(pending.size());
+		for (size_t i = 0; i < pending.size(); i++)
+		{
+			dap::Source source;
+			if (pexCache && pexCache->GetSourceData(*pending[i].second, source))
+			{
+				sources[i] = std::move(source);
+				// someone is looking at this stack's trace, so its sources are likely to be opened next
+				pexCache->QueueDecompilation(*pending[i].second);
+			}
 		}
 
+		// the VM may have resumed in the meantime, in which case the handles are gone and there's nothing to do
+		std::lock_guard lock(m_handlesMutex);
+		for (size_t i = 0; i < pending.size(); i++)
+		{
+			const auto child = m_handles->find(pending[i].first);
+			if (child == m_handles->end() || !child->second.pendingSource)
+			{
+				continue;
+			}
+
+			if (const auto stackFrame = std::get_if<dap::StackFrame>(&child->second.protocol))
+			{
+				if (sources[i])
+				{
+					stackFrame->source = *sources[i];
+				}
+				else
+				{
+					// a line is no use without the source it's in
+					stackFrame->line = 0;
+				}
+			}
+			child->second.pendingSource = nullptr;
+		}
+	}
+
+	template <typename T>
+	bool RuntimeState::CopySerializedChildren(const uint32_t id, std::vector<T>& items)
+	{
+		const auto handle = m_handles->find(id);
+		if (handle == m_handles->end() || !handle->second.children)
+		{
+			return false;
+		}
+
+		const auto& children = *handle->second.children;
+		if (!std::all_of(children.begin(), children.end(), [this](const uint32_t childId) {
+			const auto& child = m_handles->at(childId);
+			return child.serialized && !child.pendingSource;
+		}))
+		{
+			return false;
+		}
+
+		for (const auto childId : children)
+		{
+			if (const auto item = std::get_if<T>(&m_handles->at(childId).protocol))
+			{
+				items.push_back(*item);
+			}
+		}
 		return true;
 	}
 
-	bool RuntimeState::ResolveStateById(const uint32_t id, std::shared_ptr<StateNodeBase>& node)
+	template <typename T>
+	bool RuntimeState::GetSerializedChildren(const uint32_t id, PexCache* pexCache, std::vector<T>& items)
 	{
-		std::string path;
+		{
+			std::lock_guard lock(m_handlesMutex);
+			if (CopySerializedChildren(id, items))
+			{
+				return true;
+			}
+		}
 
-		if (m_paths->Get(id, path))
+		// a snapshot leaves the frames' sources to whoever asks for them first, which doesn't need the VM
+		ResolvePendingSources(id, pexCache);
 		{
-			return ResolveStateByPath(path, node);
+			std::lock_guard lock(m_handlesMutex);
+			if (CopySerializedChildren(id, items))
+			{
+				return true;
+			}
 		}
 
-		return false;
+		// not captured yet, so this node's children are read from the VM; nothing else is held up for longer than that
+		{
+			const auto vm = VirtualMachine::GetSingleton();
+			RE::BSSpinLockGuard vmLock(vm->runningStacksLock);
+			std::lock_guard lock(m_handlesMutex);
+			if (!SerializeChildren<T>(id))
+			{
+				return false;
+			}
+		}
+
+		ResolvePendingSources(id, pexCache);
+		std::lock_guard lock(m_handlesMutex);
+		return CopySerializedChildren(id, items);
 	}
 
-	bool RuntimeState::ResolveChildrenByParentPath(const std::string requestedPath, std::vector<std::shared_ptr<StateNodeBase>>& nodes)
+	void RuntimeState::Snapshot(const uint32_t stackId)
 	{
-		std::shared_ptr<StateNodeBase> resolvedParent;
-		if (!ResolveStateByPath(requestedPath, resolvedParent))
+		const auto vm = VirtualMachine::GetSingleton();
+		RE::BSSpinLockGuard vmLock(vm->runningStacksLock);
+		std::lock_guard lock(m_handlesMutex);
+
+		std::vector<dap::Thread> threads;
+		if (SerializeThreads(threads))
+		{
+			m_threads = std::move(threads);
+		}
+
+		// the frames' sources are left for the stack trace request, so no PEX is read on the stopped thread
+		uint32_t stackHandle;
+		if (!ResolvePathHandle(std::to_string(stackId), stackHandle) || !SerializeChildren<dap::StackFrame>(stackHandle))
+		{
+			return;
+		}
+
+		// unordered_map never moves its elements, so these child lists stay put while their children are added
+		for (const auto frameId : *m_handles->at(stackHandle).children)
+		{
+			if (!SerializeChildren<dap::Scope>(frameId))
+			{
+				continue;
+			}
+
+			for (const auto scopeId : *m_handles->at(frameId).children)
+			{
+				if (!SerializeChildren<dap::Variable>(scopeId))
+				{
+					continue;
+				}
+
+				for (const auto variableId : *m_handles->at(scopeId).children)
+				{
+					// arrays are paged in by the client, there's no telling which page it wants first
+					if (dynamic_cast<IIndexedState*>(m_handles->at(variableId).node.get()))
+					{
+						continue;
+					}
+
+					// values have no children, which is fine
+					SerializeChildren<dap::Variable>(variableId);
+				}
+			}
+		}
+	}
+
+	bool RuntimeState::SerializeStackFrames(const uint32_t stackId, PexCache* pexCache, std::vector<dap::StackFrame>& frames)
+	{
+		uint32_t id;
+		{
+			std::lock_guard lock(m_handlesMutex);
+			if (!ResolvePathHandle(std::to_string(stackId), id))
+			{
+				return false;
+			}
+		}
+
+		return GetSerializedChildren(id, pexCache, frames);
+	}
+
+	bool RuntimeState::SerializeScopes(const uint32_t frameId, std::vector<dap::Scope>& scopes)
+	{
+		return GetSerializedChildren(frameId, nullptr, scopes);
+	}
+
+	bool RuntimeState::SerializeElements(const uint32_t id, const uint32_t start, const uint32_t count)
+	{
+		const auto handle = m_handles->find(id);
+		if (handle == m_handles->end())
 		{
 			return false;
 		}
 
-		auto structured = dynamic_cast<IStructuredState*>(resolvedParent.get());
-		if (!structured)
+		const auto indexed = dynamic_cast<IIndexedState*>(handle->second.node.get());
+		if (!indexed)
 		{
 			return false;
 		}
 
-		std::vector<std::string> childNames;
-		structured->GetChildNames(childNames);
+		// element handles go into the same table, but references to its entries survive that
+		auto& parent = handle->second;
+		if (!parent.elements)
+		{
+			parent.elements.emplace(&m_arena);
+			parent.elementCount = indexed->GetElementCount();
+		}
+
+		const auto end = count > 0 ? static_cast<uint32_t>(std::min<uint64_t>(parent.elementCount, uint64_t{ start } + count)) : parent.elementCount;
+		for (auto index = start; index < end; index++)
+		{
+			auto element = parent.elements->find(index);
+			if (element == parent.elements->end())
+			{
+				std::shared_ptr<StateNodeBase> elementNode;
+				if (!indexed->GetElementNode(index, elementNode))
+				{
+					// e.g. a None in a Var[]; the client still gets a row for it, so the page keeps its shape
+					parent.elements->emplace(index, kMissingElement);
+					continue;
+				}
+				element = parent.elements->emplace(index, AddHandle(elementNode, parent.stackId)).first;
+			}
+			if (element->second == kMissingElement)
+			{
+				continue;
+			}
+
+			auto& child = m_handles->at(element->second);
+			if (!child.serialized)
+			{
+				dap::Variable variable;
+				if (SerializeNode(child.node.get(), child.pendingSource, variable))
+				{
+					child.protocol = std::move(variable);
+				}
+				child.serialized = true;
+			}
+		}
+		return true;
+	}
+
+	bool RuntimeState::CopySerializedElements(const uint32_t id, const uint32_t start, const uint32_t count, std::vector<dap::Variable>& variables)
+	{
+		const auto handle = m_handles->find(id);
+		if (handle == m_handles->end() || !handle->second.elements)
+		{
+			return false;
+		}
 
-		for (const auto& childName : childNames)
+		const auto& parent = handle->second;
+		const auto end = count > 0 ? static_cast<uint32_t>(std::min<uint64_t>(parent.elementCount, uint64_t{ start } + count)) : parent.elementCount;
+		std::vector<dap::Variable> window;
+		window.reserve(end > start ? end - start : 0);
+		for (auto index = start; index < end; index++)
 		{
-			std::shared_ptr<StateNodeBase> childNode;
-			if (ResolveStateByPath(StringFormat("%s.%s", requestedPath.c_str(), childName.c_str()), childNode))
+			const auto element = parent.elements->find(index);
+			if (element == parent.elements->end())
+			{
+				return false;
+			}
+			if (element->second == kMissingElement)
+			{
+				window.push_back(dap::Variable{ .name = std::to_string(index), .value = "None" });
+				continue;
+			}
+
+			const auto& child = m_handles->at(element->second);
+			if (!child.serialized)
+			{
+				return false;
+			}
+			if (const auto variable = std::get_if<dap::Variable>(&child.protocol))
 			{
-				nodes.push_back(childNode);
+				window.push_back(*variable);
 			}
 		}
 
+		variables.insert(variables.end(), std::make_move_iterator(window.begin()), std::make_move_iterator(window.end()));
 		return true;
 	}
 
-	bool RuntimeState::ResolveChildrenByParentId(const uint32_t id, std::vector<std::shared_ptr<StateNodeBase>>& nodes)
+	bool RuntimeState::GetSerializedElements(const uint32_t id, const uint32_t start, const uint32_t count, std::vector<dap::Variable>& variables)
 	{
-		std::string path;
+		{
+			std::lock_guard lock(m_handlesMutex);
+			if (CopySerializedElements(id, start, count, variables))
+			{
+				return true;
+			}
+		}
+
+		const auto vm = VirtualMachine::GetSingleton();
+		RE::BSSpinLockGuard vmLock(vm->runningStacksLock);
+		std::lock_guard lock(m_handlesMutex);
+		return SerializeElements(id, start, count) && CopySerializedElements(id, start, count, variables);
+	}
 
-		if (m_paths->Get(id, path))
+	bool RuntimeState::SerializeVariables(const uint32_t id, const VariablesPage& page, std::vector<dap::Variable>& variables)
+	{
+		bool isIndexed;
+		{
+			std::lock_guard lock(m_handlesMutex);
+			const auto handle = m_handles->find(id);
+			if (handle == m_handles->end())
+			{
+				return false;
+			}
+			isIndexed = dynamic_cast<IIndexedState*>(handle->second.node.get()) != nullptr;
+		}
+
+		if (isIndexed)
+		{
+			// nothing indexed has named children
+			return !page.indexed || GetSerializedElements(id, page.start, page.count, variables);
+		}
+
+		if (!page.named)
 		{
-			return ResolveChildrenByParentPath(path, nodes);
+			return true;
 		}
 
-		return false;
+		std::vector<dap::Variable> children;
+		if (!GetSerializedChildren(id, nullptr, children))
+		{
+			return false;
+		}
+
+		const auto start = std::min<size_t>(page.start, children.size());
+		const auto end = page.count > 0 ? std::min<size_t>(start + page.count, children.size()) : children.size();
+		variables.insert(variables.end(), std::make_move_iterator(children.begin() + start), std::make_move_iterator(children.begin() + end));
+		return true;
 	}
 
 	std::shared_ptr<StateNodeBase> RuntimeState::CreateNodeForVariable(std::string name, const RE::BSScript::Variable* variable)
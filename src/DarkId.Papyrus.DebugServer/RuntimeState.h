@@ -1,25 +1,113 @@
 #pragma once
 
-#include "IdMap.h"
+#include "IdProvider.h"
 
 #include "GameInterfaces.h"
 #include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <variant>
 #include <vector>
 #include "StateNodeBase.h"
 
 namespace DarkId::Papyrus::DebugServer
 {
+	class PexCache;
+	struct ScriptIdentity;
+
+	// Which of a node's variables a variables request wants. start and count page through the elements of indexed
+	// nodes, and through the children of everything else.
+	struct VariablesPage
+	{
+		bool named = true;
+		bool indexed = true;
+		uint32_t start = 0;
+		// 0 for all of them
+		uint32_t count = 0;
+	};
+
 	class RuntimeState
 	{
-		std::unique_ptr<IdMap<std::string>> m_paths;
+		// A node handed to the client while paused. Its children are looked up once and kept, so expanding
+		// the same variable again, or one of its children, is a table lookup.
+		struct Handle
+		{
+			std::shared_ptr<StateNodeBase> node;
+			// the stack the node belongs to, so a stack resumed on its own can drop just its handles
+			uint32_t stackId = 0;
+			std::optional<std::pmr::vector<uint32_t>> children;
+			// For indexed nodes, the handles of the elements looked up so far, by index, and how many there are.
+			// An element the VM had no value for is kMissingElement.
+			std::optional<std::pmr::unordered_map<uint32_t, uint32_t>> elements;
+			uint32_t elementCount = 0;
+			// What the node looked like to the client when it was first serialized; monostate if it has no such form
+			bool serialized = false;
+			std::variant<std::monostate, dap::StackFrame, dap::Scope, dap::Variable> protocol;
+			// For frames, the script whose source still has to be filled in, which is done off the VM's lock
+			const ScriptIdentity* pendingSource = nullptr;
+		};
+
+		// never a real id, which always has a non-zero generation
+		static constexpr uint32_t kMissingElement = 0;
+
+		std::shared_ptr<IdProvider> m_idProvider;
+		std::recursive_mutex m_handlesMutex;
+		// Everything the tables below allocate comes from here and is thrown away in one go when the pause ends.
+		// The tables are rebuilt rather than cleared, since an empty table can still hold memory from the arena.
+		std::pmr::monotonic_buffer_resource m_arena;
+		std::optional<std::pmr::unordered_map<uint32_t, Handle>> m_handles;
+		// roots the client asked for by path (stacks), so repeated requests hand out the same frame ids
+		std::optional<std::pmr::unordered_map<std::pmr::string, uint32_t>> m_pathHandles;
+		// the threads as of the last snapshot; without one they're listed from the VM on every request
+		std::optional<std::vector<dap::Thread>> m_threads;
+
+		uint32_t AddHandle(const std::shared_ptr<StateNodeBase>& node, uint32_t stackId);
+		bool ResolvePathHandle(const std::string& requestedPath, uint32_t& id);
+		const std::pmr::vector<uint32_t>* MaterializeChildren(uint32_t id);
+		// Expects the VM's running stacks lock and m_handlesMutex to be held, in that order
+		bool SerializeThreads(std::vector<dap::Thread>& threads);
+
+		// Expects the VM's running stacks lock and m_handlesMutex to be held, in that order
+		template <typename T>
+		bool SerializeChildren(uint32_t id);
+		// Fills in the sources of the node's frame children; takes m_handlesMutex itself and mustn't be called with
+		// the VM's running stacks lock held, since it may read PEX files
+		void ResolvePendingSources(uint32_t id, PexCache* pexCache);
+		// Expects m_handlesMutex to be held; false unless every child has already been serialized
+		template <typename T>
+		bool CopySerializedChildren(uint32_t id, std::vector<T>& items);
+		template <typename T>
+		bool GetSerializedChildren(uint32_t id, PexCache* pexCache, std::vector<T>& items);
+
+		// Like the above, for the elements of an indexed node in [start, start + count)
+		bool SerializeElements(uint32_t id, uint32_t start, uint32_t count);
+		bool CopySerializedElements(uint32_t id, uint32_t start, uint32_t count, std::vector<dap::Variable>& variables);
+		bool GetSerializedElements(uint32_t id, uint32_t start, uint32_t count, std::vector<dap::Variable>& variables);
 
 	public:
 		explicit RuntimeState(const std::shared_ptr<IdProvider>& idProvider);
 
+		// Nodes point straight into VM state that's only stable while paused; drop them all when execution resumes.
+		// Ids handed out before this are from an old generation and won't resolve again.
+		void InvalidateHandles();
+		// For a single stack resumed while the rest stay paused; the other stacks keep their ids
+		void InvalidateStackHandles(uint32_t stackId);
+		bool IsStale(uint32_t id) const;
+
+		// Captures the threads, a paused stack's frames, their scopes and variables, and the fields of those
+		// variables, so the client's first requests after a stop can be answered without touching the VM.
+		void Snapshot(uint32_t stackId);
+
+		// Serve what was captured, and only take the VM's running stacks lock for the one node being expanded otherwise
+		bool GetThreads(std::vector<dap::Thread>& threads);
+		bool SerializeStackFrames(uint32_t stackId, PexCache* pexCache, std::vector<dap::StackFrame>& frames);
+		bool SerializeScopes(uint32_t frameId, std::vector<dap::Scope>& scopes);
+		bool SerializeVariables(uint32_t id, const VariablesPage& page, std::vector<dap::Variable>& variables);
+
 		bool ResolveStateByPath(std::string requestedPath, std::shared_ptr<StateNodeBase>& node);
-		bool ResolveStateById(uint32_t id, std::shared_ptr<StateNodeBase>& node);
-		bool ResolveChildrenByParentPath(std::string requestedPath, std::vector<std::shared_ptr<StateNodeBase>>& nodes);
-		bool ResolveChildrenByParentId(uint32_t id, std::vector<std::shared_ptr<StateNodeBase>>& nodes);
 
 		static std::shared_ptr<StateNodeBase> CreateNodeForVariable(std::string name, const RE::BSScript::Variable* variable);
 		
@@ -0,0 +1,101 @@
+#include "ScriptIdentityCache.h"
+#include "Utilities.h"
+
+#include <mutex>
+
+namespace DarkId::Papyrus::DebugServer
+{
+	ScriptIdentityCache& ScriptIdentityCache::GetSingleton()
+	{
+		static ScriptIdentityCache singleton;
+		return singleton;
+	}
+
+	const ScriptIdentity& ScriptIdentityCache::Get(RE::BSScript::ObjectTypeInfo* typeInfo)
+	{
+		{
+			std::shared_lock lock(m_mutex);
+			const auto entry = m_byTypeInfo.find(typeInfo);
+			if (entry != m_byTypeInfo.end() && entry->second.name == typeInfo->GetName())
+			{
+				return *entry->second.identity;
+			}
+		}
+
+		std::string name(typeInfo->GetName());
+		const auto& identity = Get(name);
+
+		std::unique_lock lock(m_mutex);
+		m_byTypeInfo.insert_or_assign(typeInfo, TypeInfoEntry{
+			.name = std::move(name),
+			.identity = &identity
+		});
+
+		return identity;
+	}
+
+	const ScriptIdentity& ScriptIdentityCache::Get(const std::string& scriptName)
+	{
+		{
+			std::shared_lock lock(m_mutex);
+			const auto entry = m_byRawName.find(scriptName);
+			if (entry != m_byRawName.end())
+			{
+				return *entry->second;
+			}
+		}
+
+		std::unique_lock lock(m_mutex);
+		return Intern(scriptName);
+	}
+
+	const ScriptIdentity* ScriptIdentityCache::Find(const uint32_t id) const
+	{
+		std::shared_lock lock(m_mutex);
+		if (id == 0 || id > m_identities.size())
+		{
+			return nullptr;
+		}
+
+		return &m_identities[id - 1];
+	}
+
+	void ScriptIdentityCache::ClearLookups()
+	{
+		std::unique_lock lock(m_mutex);
+		m_byTypeInfo.clear();
+		m_byRawName.clear();
+	}
+
+	const ScriptIdentity& ScriptIdentityCache::Intern(const std::string& scriptName)
+	{
+		const auto normalizedName = NormalizeScriptName(scriptName);
+		const auto key = ToLowerCopy(normalizedName);
+
+		const ScriptIdentity* identity;
+		const auto existing = m_byKey.find(key);
+		if (existing != m_byKey.end())
+		{
+			identity = existing->second;
+		}
+		else
+		{
+			identity = &m_identities.emplace_back(ScriptIdentity{
+				.id = static_cast<uint32_t>(m_identities.size() + 1),
+				.normalizedName = normalizedName,
+				.key = key,
+				.pexPath = ScriptNameToPEXPath(normalizedName),
+				.pscPath = ScriptNameToPSCPath(normalizedName)
+			});
+			m_byKey.emplace(key, identity);
+		}
+
+		m_byRawName.emplace(scriptName, identity);
+		return *identity;
+	}
+
+	int GetScriptReference(const std::string& scriptName)
+	{
+		return static_cast<int>(ScriptIdentityCache::GetSingleton().Get(scriptName).id);
+	}
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "GameInterfaces.h"
+
+#include <deque>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+namespace DarkId::Papyrus::DebugServer
+{
+	// Everything we derive from a script name, computed once per script per session
+	struct ScriptIdentity
+	{
+		// Stable, collision-free id; also used as the DAP sourceReference
+		uint32_t id;
+		// e.g. "MyMod:Quests:MyQuestScript"
+		std::string normalizedName;
+		// lowercased normalizedName, the key for name lookups
+		std::string key;
+		// e.g. "MyMod/Quests/MyQuestScript.pex", relative to the Scripts folder
+		std::string pexPath;
+		// e.g. "MyMod/Quests/MyQuestScript.psc"
+		std::string pscPath;
+	};
+
+	class ScriptIdentityCache
+	{
+	public:
+		static ScriptIdentityCache& GetSingleton();
+
+		// Fast path for anything that has the VM's type info at hand
+		const ScriptIdentity& Get(RE::BSScript::ObjectTypeInfo* typeInfo);
+		// Accepts any spelling of the script name (namespaced name, relative path, with or without extension)
+		const ScriptIdentity& Get(const std::string& scriptName);
+		const ScriptIdentity* Find(uint32_t id) const;
+		// Forgets type info addresses and raw spellings, e.g. when the VM may be about to unload types.
+		// Identities themselves are kept, so ids and references handed out earlier stay valid.
+		void ClearLookups();
+	private:
+		struct TypeInfoEntry
+		{
+			// the address alone isn't enough: a type can be unloaded and another one allocated in its place
+			std::string name;
+			const ScriptIdentity* identity;
+		};
+
+		ScriptIdentityCache() = default;
+
+		const ScriptIdentity& Intern(const std::string& scriptName);
+
+		mutable std::shared_mutex m_mutex;
+		std::deque<ScriptIdentity> m_identities;
+		std::unordered_map<std::string, const ScriptIdentity*> m_byKey;
+		// raw spellings we've been asked about, so repeat lookups skip normalization
+		std::unordered_map<std::string, const ScriptIdentity*> m_byRawName;
+		std::unordered_map<const RE::BSScript::ObjectTypeInfo*, TypeInfoEntry> m_byTypeInfo;
+	};
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <ios>
+#include <span>
+#include <streambuf>
+
+namespace DarkId::Papyrus::DebugServer
+{
+	// Lets Pex::FileReader parse straight out of a buffer we already have, without copying it into a stringstream
+	class SpanStreamBuf : public std::streambuf
+	{
+	public:
+		explicit SpanStreamBuf(const std::span<const char> data)
+		{
+			const auto begin = const_cast<char*>(data.data());
+			setg(begin, begin, begin + data.size());
+		}
+	protected:
+		pos_type seekoff(const off_type offset, const std::ios_base::seekdir dir, const std::ios_base::openmode which) override
+		{
+			if (!(which & std::ios_base::in))
+			{
+				return pos_type(off_type(-1));
+			}
+
+			off_type position;
+			switch (dir)
+			{
+			case std::ios_base::beg:
+				position = offset;
+				break;
+			case std::ios_base::cur:
+				position = (gptr() - eback()) + offset;
+				break;
+			case std::ios_base::end:
+				position = (egptr() - eback()) + offset;
+				break;
+			default:
+				return pos_type(off_type(-1));
+			}
+
+			if (position < 0 || position > egptr() - eback())
+			{
+				return pos_type(off_type(-1));
+			}
+
+			setg(eback(), eback() + position, egptr());
+			return pos_type(position);
+		}
+
+		pos_type seekpos(const pos_type position, const std::ios_base::openmode which) override
+		{
+			return seekoff(off_type(position), std::ios_base::beg, which);
+		}
+	};
+}
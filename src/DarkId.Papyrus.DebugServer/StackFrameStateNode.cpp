@@ -12,22 +12,15 @@ namespace DarkId::Papyrus::DebugServer
 
 	}
 
-	bool StackFrameStateNode::SerializeToProtocol(dap::StackFrame& stackFrame, PexCache* pexCache) const
+	bool StackFrameStateNode::SerializeToProtocol(dap::StackFrame& stackFrame, const ScriptIdentity*& script) const
 	{
 		stackFrame.id = GetId();
-		dap::Source source;
-		std::string ScriptName = NormalizeScriptName(m_stackFrame->owningObjectType->GetName());
-		// TODO: ignoring this for now, just for debugging reference
-		std::string srcFileName = m_stackFrame->owningFunction->GetSourceFilename().c_str();
-		if (pexCache->GetSourceData(ScriptName.c_str(), source))
+		script = &ScriptIdentityCache::GetSingleton().Get(m_stackFrame->owningObjectType.get());
+		uint32_t ip = m_stackFrame->STACK_FRAME_IP;
+		uint32_t lineNumber;
+		if (m_stackFrame->owningFunction->TranslateIPToLineNumber(ip, lineNumber))
 		{
-			stackFrame.source = source;
-			uint32_t ip = m_stackFrame->STACK_FRAME_IP;
-			uint32_t lineNumber;
-			if (m_stackFrame->owningFunction->TranslateIPToLineNumber(ip, lineNumber))
-			{
-				stackFrame.line = lineNumber;
-			}
+			stackFrame.line = lineNumber;
 		}
 
 		auto name = std::string(m_stackFrame->owningFunction->GetName().c_str());
@@ -3,7 +3,7 @@
 #include "GameInterfaces.h"
 
 #include <dap/protocol.h>
-#include "PexCache.h"
+#include "ScriptIdentityCache.h"
 #include "StateNodeBase.h"
 
 namespace DarkId::Papyrus::DebugServer
@@ -15,7 +15,8 @@ namespace DarkId::Papyrus::DebugServer
 	public:
 		explicit StackFrameStateNode(RE::BSScript::StackFrame* stackFrame);
 
-		bool SerializeToProtocol(dap::StackFrame& stackFrame, PexCache* pexCache) const;
+		// Everything but the source, which means reading the script's PEX; `script` is the one to read it from
+		bool SerializeToProtocol(dap::StackFrame& stackFrame, const ScriptIdentity*& script) const;
 
 		bool GetChildNames(std::vector<std::string>& names) override;
 		bool GetChildNode(std::string name, std::shared_ptr<StateNodeBase>& node) override;
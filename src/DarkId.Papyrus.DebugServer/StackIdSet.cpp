@@ -0,0 +1,177 @@
+#include "StackIdSet.h"
+
+namespace DarkId::Papyrus::DebugServer
+{
+	StackIdSet::Table::Table(const size_t slotCount) :
+		slotCount(slotCount), slots(std::make_unique<std::atomic<uint32_t>[]>(slotCount))
+	{
+		for (size_t i = 0; i < slotCount; i++)
+		{
+			slots[i].store(kEmpty, std::memory_order_relaxed);
+		}
+	}
+
+	StackIdSet::StackIdSet()
+	{
+		m_tables.push_back(std::make_unique<Table>(kInitialSlotCount));
+		m_table.store(m_tables.back().get(), std::memory_order_release);
+	}
+
+	size_t StackIdSet::GetSlotIndex(const uint32_t stackId, const size_t slotCount)
+	{
+		// stack ids are handed out sequentially, so spread them before masking
+		return static_cast<size_t>(stackId * 0x9E3779B9u) & (slotCount - 1);
+	}
+
+	bool StackIdSet::Contains(const uint32_t stackId) const
+	{
+		if (stackId == kEmpty || stackId == kTombstone || IsEmpty())
+		{
+			return false;
+		}
+
+		const auto table = m_table.load(std::memory_order_acquire);
+		const auto mask = table->slotCount - 1;
+		const auto start = GetSlotIndex(stackId, table->slotCount);
+		for (size_t probe = 0; probe < table->slotCount; probe++)
+		{
+			const auto value = table->slots[(start + probe) & mask].load(std::memory_order_acquire);
+			if (value == stackId)
+			{
+				return true;
+			}
+			if (value == kEmpty)
+			{
+				return false;
+			}
+		}
+
+		return false;
+	}
+
+	bool StackIdSet::InsertInto(Table& table, const uint32_t stackId)
+	{
+		const auto mask = table.slotCount - 1;
+		const auto start = GetSlotIndex(stackId, table.slotCount);
+		for (size_t probe = 0; probe < table.slotCount; probe++)
+		{
+			auto& slot = table.slots[(start + probe) & mask];
+			const auto value = slot.load(std::memory_order_relaxed);
+			if (value == kEmpty || value == kTombstone)
+			{
+				slot.store(stackId, std::memory_order_release);
+				return value == kEmpty;
+			}
+		}
+
+		return false;
+	}
+
+	void StackIdSet::Rebuild()
+	{
+		const auto current = m_table.load(std::memory_order_relaxed);
+		const auto live = m_count.load(std::memory_order_relaxed);
+		// mostly tombstones: the same size will do
+		const auto slotCount = live * 2 >= current->slotCount / 2 ? current->slotCount * 2 : current->slotCount;
+
+		auto rebuilt = std::make_unique<Table>(slotCount);
+		m_used = 0;
+		for (size_t i = 0; i < current->slotCount; i++)
+		{
+			const auto value = current->slots[i].load(std::memory_order_relaxed);
+			if (value != kEmpty && value != kTombstone)
+			{
+				InsertInto(*rebuilt, value);
+				m_used++;
+			}
+		}
+
+		m_tables.push_back(std::move(rebuilt));
+		m_table.store(m_tables.back().get(), std::memory_order_release);
+	}
+
+	bool StackIdSet::Insert(const uint32_t stackId)
+	{
+		if (stackId == kEmpty || stackId == kTombstone)
+		{
+			return false;
+		}
+
+		std::lock_guard<std::mutex> lock(m_writeMutex);
+		if (Contains(stackId))
+		{
+			return false;
+		}
+
+		if ((m_used + 1) * 4 > m_table.load(std::memory_order_relaxed)->slotCount * 3)
+		{
+			Rebuild();
+		}
+
+		// probing stops at the first free slot, and a lookup can't miss an id that's behind a tombstone
+		if (InsertInto(*m_table.load(std::memory_order_relaxed), stackId))
+		{
+			m_used++;
+		}
+		m_count.fetch_add(1, std::memory_order_release);
+		return true;
+	}
+
+	bool StackIdSet::Remove(const uint32_t stackId)
+	{
+		if (stackId == kEmpty || stackId == kTombstone)
+		{
+			return false;
+		}
+
+		std::lock_guard<std::mutex> lock(m_writeMutex);
+		const auto table = m_table.load(std::memory_order_relaxed);
+		const auto mask = table->slotCount - 1;
+		const auto start = GetSlotIndex(stackId, table->slotCount);
+		for (size_t probe = 0; probe < table->slotCount; probe++)
+		{
+			auto& slot = table->slots[(start + probe) & mask];
+			const auto value = slot.load(std::memory_order_relaxed);
+			if (value == stackId)
+			{
+				m_count.fetch_sub(1, std::memory_order_release);
+
+				// A slot followed by an empty one isn't on the way to any id, so it can be emptied rather than left
+				// as a tombstone, and so can the tombstones right before it. Only a tombstone in the middle of a run
+				// has to stay, and keeps counting towards m_used until the next rebuild.
+				auto index = (start + probe) & mask;
+				if (table->slots[(index + 1) & mask].load(std::memory_order_relaxed) != kEmpty)
+				{
+					slot.store(kTombstone, std::memory_order_release);
+					return true;
+				}
+
+				do
+				{
+					table->slots[index].store(kEmpty, std::memory_order_release);
+					m_used--;
+					index = (index - 1) & mask;
+				} while (table->slots[index].load(std::memory_order_relaxed) == kTombstone);
+				return true;
+			}
+			if (value == kEmpty)
+			{
+				return false;
+			}
+		}
+
+		return false;
+	}
+
+	void StackIdSet::Clear()
+	{
+		std::lock_guard<std::mutex> lock(m_writeMutex);
+		const auto table = m_table.load(std::memory_order_relaxed);
+		for (size_t i = 0; i < table->slotCount; i++)
+		{
+			table->slots[i].store(kEmpty, std::memory_order_release);
+		}
+		m_used = 0;
+		m_count.store(0, std::memory_order_release);
+	}
+}
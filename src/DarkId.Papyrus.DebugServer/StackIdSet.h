@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace DarkId::Papyrus::DebugServer
+{
+	// Open-addressing set of stack ids, cheap enough to query from the instruction hook.
+	// Contains() is lock-free. Changes are serialized; they clear tombstones wherever that can't cut a lookup short,
+	// and move the set to a bigger table once it fills up, so lookups stay short and the set never runs out of room.
+	class StackIdSet
+	{
+	public:
+		StackIdSet();
+
+		bool Contains(uint32_t stackId) const;
+		bool Insert(uint32_t stackId);
+		bool Remove(uint32_t stackId);
+		void Clear();
+		bool IsEmpty() const { return m_count.load(std::memory_order_acquire) == 0; }
+	private:
+		static constexpr size_t kInitialSlotCount = 64;
+		static constexpr uint32_t kEmpty = 0;
+		static constexpr uint32_t kTombstone = UINT32_MAX;
+
+		struct Table
+		{
+			explicit Table(size_t slotCount);
+
+			size_t slotCount;
+			std::unique_ptr<std::atomic<uint32_t>[]> slots;
+		};
+
+		std::atomic<Table*> m_table;
+		std::atomic<uint32_t> m_count = 0;
+
+		std::mutex m_writeMutex;
+		// ids plus tombstones in the current table
+		size_t m_used = 0;
+		// Replaced tables are kept, since a hook thread may still be probing one. Tables mostly get replaced by
+		// ones twice the size, so there are only ever a handful of them.
+		std::vector<std::unique_ptr<Table>> m_tables;
+
+		static size_t GetSlotIndex(uint32_t stackId, size_t slotCount);
+		static bool InsertInto(Table& table, uint32_t stackId);
+		void Rebuild();
+	};
+}
@@ -37,4 +37,12 @@ namespace DarkId::Papyrus::DebugServer
 		virtual bool GetChildNames(std::vector<std::string>& names) = 0;
 		virtual bool GetChildNode(std::string name, std::shared_ptr<StateNodeBase>& node) = 0;
 	};
+
+	// State whose children are a run of elements that can be looked up by position, without naming all of them first
+	class IIndexedState
+	{
+	public:
+		virtual uint32_t GetElementCount() = 0;
+		virtual bool GetElementNode(uint32_t index, std::shared_ptr<StateNodeBase>& node) = 0;
+	};
 }
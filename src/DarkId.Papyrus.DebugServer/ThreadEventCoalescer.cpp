@@ -0,0 +1,113 @@
+#include "ThreadEventCoalescer.h"
+
+#include <algorithm>
+
+namespace DarkId::Papyrus::DebugServer
+{
+	void ThreadEventCoalescer::Configure(const std::chrono::milliseconds window, const bool summaryOnly)
+	{
+		m_window = window;
+		m_summaryOnly = summaryOnly;
+	}
+
+	void ThreadEventCoalescer::Started(const uint32_t stackId, const Clock::time_point at)
+	{
+		m_summary.started++;
+		m_summary.running++;
+		m_summaryChanged = true;
+
+		if (m_summaryOnly || m_window.count() <= 0)
+		{
+			if (!m_summaryOnly)
+			{
+				m_ready.push_back(dap::ThreadEvent{ .reason = "started", .threadId = stackId });
+			}
+			return;
+		}
+		m_pendingStarts.insert_or_assign(stackId, at);
+	}
+
+	void ThreadEventCoalescer::Exited(const uint32_t stackId, const Clock::time_point at)
+	{
+		m_summary.exited++;
+		if (m_summary.running > 0)
+		{
+			m_summary.running--;
+		}
+		m_summaryChanged = true;
+
+		const auto pending = m_pendingStarts.find(stackId);
+		if (pending != m_pendingStarts.end())
+		{
+			// the client never heard of it, so it doesn't need to hear that it's gone
+			if (at - pending->second < m_window)
+			{
+				m_pendingStarts.erase(pending);
+				m_summary.coalesced++;
+				return;
+			}
+
+			// outlived the window, but hasn't been flushed yet
+			m_ready.push_back(dap::ThreadEvent{ .reason = "started", .threadId = stackId });
+			m_pendingStarts.erase(pending);
+		}
+
+		if (!m_summaryOnly)
+		{
+			m_ready.push_back(dap::ThreadEvent{ .reason = "exited", .threadId = stackId });
+		}
+	}
+
+	void ThreadEventCoalescer::Flush(const Clock::time_point now, std::vector<dap::ThreadEvent>& events)
+	{
+		struct DueStart
+		{
+			uint32_t stackId;
+			Clock::time_point at;
+		};
+		std::vector<DueStart> due;
+		for (auto it = m_pendingStarts.begin(); it != m_pendingStarts.end();)
+		{
+			if (now - it->second >= m_window)
+			{
+				due.push_back(DueStart{ .stackId = it->first, .at = it->second });
+				it = m_pendingStarts.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+		std::sort(due.begin(), due.end(), [](const DueStart& a, const DueStart& b) { return a.at < b.at; });
+
+		// events already in m_ready happened before anything still pending was due
+		events.insert(events.end(), std::make_move_iterator(m_ready.begin()), std::make_move_iterator(m_ready.end()));
+		m_ready.clear();
+		for (const auto& start : due)
+		{
+			events.push_back(dap::ThreadEvent{ .reason = "started", .threadId = start.stackId });
+		}
+	}
+
+	bool ThreadEventCoalescer::TakeSummary(ThreadEventSummary& summary)
+	{
+		if (!m_summaryChanged)
+		{
+			return false;
+		}
+		summary = m_summary;
+		m_summary.started = 0;
+		m_summary.exited = 0;
+		m_summary.coalesced = 0;
+		m_summaryChanged = false;
+		return true;
+	}
+
+	void ThreadEventCoalescer::Reset()
+	{
+		m_pendingStarts.clear();
+		m_ready.clear();
+		m_summary = {};
+		m_summaryChanged = false;
+	}
+}
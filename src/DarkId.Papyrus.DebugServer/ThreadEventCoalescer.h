@@ -0,0 +1,50 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <dap/protocol.h>
+
+namespace DarkId::Papyrus::DebugServer
+{
+	// Counts since the last summary was taken
+	struct ThreadEventSummary
+	{
+		uint64_t started;
+		uint64_t exited;
+		// started/exited pairs that were never reported because the stack was too short-lived
+		uint64_t coalesced;
+		size_t running;
+	};
+
+	// Sits between the stack hooks and the client. A stack's "started" event is held back for a short window;
+	// if the stack exits within it, neither event is sent. Whatever is left is handed out in batches by Flush.
+	// Not thread-safe; it's only used from the debugger worker.
+	class ThreadEventCoalescer
+	{
+	public:
+		using Clock = std::chrono::steady_clock;
+
+		// A zero window reports every stack; in summary-only mode no thread events are produced at all
+		void Configure(std::chrono::milliseconds window, bool summaryOnly);
+		bool IsSummaryOnly() const { return m_summaryOnly; }
+
+		void Started(uint32_t stackId, Clock::time_point at);
+		void Exited(uint32_t stackId, Clock::time_point at);
+		// Appends every event that's due by `now`, in the order they should be sent
+		void Flush(Clock::time_point now, std::vector<dap::ThreadEvent>& events);
+		// false if nothing changed since the last summary
+		bool TakeSummary(ThreadEventSummary& summary);
+		void Reset();
+	private:
+		std::chrono::milliseconds m_window{ 0 };
+		bool m_summaryOnly = false;
+
+		std::unordered_map<uint32_t, Clock::time_point> m_pendingStarts;
+		std::vector<dap::ThreadEvent> m_ready;
+		ThreadEventSummary m_summary{};
+		bool m_summaryChanged = false;
+	};
+}
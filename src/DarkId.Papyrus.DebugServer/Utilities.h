@@ -139,14 +139,8 @@ namespace DarkId::Papyrus::DebugServer
 		return name + ".pex";
 	}
 
-	inline int GetScriptReference(const std::string& scriptName)
-	{
-		constexpr std::hash<std::string> hasher{};
-		std::string name = NormalizeScriptName(scriptName);
-		std::transform(name.begin(), name.end(), name.begin(), ::tolower);
-
-		return std::abs(static_cast<int>(hasher(name))) + 1;
-	}
+	// Interned through ScriptIdentityCache, so ids are stable for the session and never collide
+	int GetScriptReference(const std::string& scriptName);
 
 	inline int GetSourceReference(const dap::Source& src) {
 		// If the source reference <= 0, it's invalid
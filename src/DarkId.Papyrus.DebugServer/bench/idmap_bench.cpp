@@ -0,0 +1,194 @@
+// IdMap operations at 1k, 100k and 1M entries (the last is close to its 2^20 slot limit), next to the pair of
+// unordered_maps behind a mutex that it replaced. Times are per operation, over enough rounds that the small
+// sizes run for about as long as the big one.
+//
+//   idmap_bench [sizes...]
+
+#include "IdMap.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+using namespace DarkId::Papyrus::DebugServer;
+
+namespace
+{
+	constexpr size_t kOperationsPerMeasurement = 4'000'000;
+
+	// What IdMap replaced: a hash map each way, with ids from a counter
+	template <typename T>
+	class HashMapIdMap
+	{
+	public:
+		bool Get(const uint32_t id, T& value)
+		{
+			std::lock_guard lock(m_mutex);
+			const auto entry = m_idsToElements.find(id);
+			if (entry == m_idsToElements.end())
+			{
+				return false;
+			}
+			value = entry->second;
+			return true;
+		}
+
+		bool AddOrGetExisting(const T& element, uint32_t& id)
+		{
+			std::lock_guard lock(m_mutex);
+			const auto [entry, added] = m_elementsToIds.try_emplace(element, m_nextId);
+			id = entry->second;
+			if (added)
+			{
+				m_idsToElements.emplace(m_nextId++, element);
+			}
+			return added;
+		}
+
+		bool Remove(const uint32_t id)
+		{
+			std::lock_guard lock(m_mutex);
+			const auto entry = m_idsToElements.find(id);
+			if (entry == m_idsToElements.end())
+			{
+				return false;
+			}
+			m_elementsToIds.erase(entry->second);
+			m_idsToElements.erase(entry);
+			return true;
+		}
+	private:
+		std::mutex m_mutex;
+		uint32_t m_nextId = 1;
+		std::unordered_map<uint32_t, T> m_idsToElements;
+		std::unordered_map<T, uint32_t> m_elementsToIds;
+	};
+
+	struct Result
+	{
+		double add = 0;
+		double addExisting = 0;
+		double get = 0;
+		double remove = 0;
+		double reuse = 0;
+	};
+
+	double Elapsed(const std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	volatile uint64_t g_sink;
+
+	template <typename TMap>
+	Result Measure(const size_t size)
+	{
+		std::vector<uint64_t> elements(size);
+		for (size_t i = 0; i < size; i++)
+		{
+			elements[i] = (i + 1) * 0x9E3779B97F4A7C15ull;
+		}
+		// ids are looked up and released in no particular order, like variables references from the editor
+		std::vector<size_t> order(size);
+		for (size_t i = 0; i < size; i++)
+		{
+			order[i] = (i * 7919) % size;
+		}
+		if (size % 7919 == 0)
+		{
+			for (size_t i = 0; i < size; i++)
+			{
+				order[i] = i;
+			}
+		}
+
+		const auto rounds = std::max<size_t>(1, kOperationsPerMeasurement / size);
+		Result result;
+		uint64_t sink = 0;
+		std::vector<uint32_t> ids(size);
+		for (size_t round = 0; round < rounds; round++)
+		{
+			TMap map;
+
+			auto start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < size; i++)
+			{
+				map.AddOrGetExisting(elements[i], ids[i]);
+			}
+			result.add += Elapsed(start);
+
+			start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < size; i++)
+			{
+				uint32_t id;
+				map.AddOrGetExisting(elements[order[i]], id);
+				sink += id;
+			}
+			result.addExisting += Elapsed(start);
+
+			start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < size; i++)
+			{
+				uint64_t element;
+				map.Get(ids[order[i]], element);
+				sink += element;
+			}
+			result.get += Elapsed(start);
+
+			start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < size; i++)
+			{
+				map.Remove(ids[order[i]]);
+			}
+			result.remove += Elapsed(start);
+
+			// everything comes back, into the slots (or buckets) that were just freed
+			start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < size; i++)
+			{
+				map.AddOrGetExisting(elements[i], ids[i]);
+			}
+			result.reuse += Elapsed(start);
+		}
+		g_sink = sink;
+
+		const auto operations = static_cast<double>(rounds * size);
+		result.add /= operations;
+		result.addExisting /= operations;
+		result.get /= operations;
+		result.remove /= operations;
+		result.reuse /= operations;
+		return result;
+	}
+
+	void Report(const char* name, const Result& result)
+	{
+		std::printf("  %-16s %8.1f %8.1f %8.1f %8.1f %8.1f\n", name, result.add, result.addExisting, result.get, result.remove, result.reuse);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<size_t> sizes;
+	for (int i = 1; i < argc; i++)
+	{
+		sizes.push_back(std::strtoull(argv[i], nullptr, 10));
+	}
+	if (sizes.empty())
+	{
+		sizes = { 1'000, 100'000, 1'000'000 };
+	}
+
+	for (const auto size : sizes)
+	{
+		std::printf("%zu entries, ns per operation\n", size);
+		std::printf("  %-16s %8s %8s %8s %8s %8s\n", "", "add", "existing", "get", "remove", "re-add");
+		Report("IdMap", Measure<IdMap<uint64_t>>(size));
+		Report("unordered_maps", Measure<HashMapIdMap<uint64_t>>(size));
+	}
+	return 0;
+}
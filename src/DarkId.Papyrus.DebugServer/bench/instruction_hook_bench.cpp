@@ -0,0 +1,278 @@
+// Instructions per second through a stand-in for the VM's interpreter loop, with the instruction hook in each of the
+// states a session can leave it in. The hook is a copy of the checks at the top of
+// DebugExecutionManager::HandleInstruction and BreakpointManager::GetExecutionIsAtValidBreakpoint, since those can't
+// run outside the game; keep them in step when either changes.
+//
+//   instruction_hook_bench [threads] [instructions per thread]
+
+#include "StackIdSet.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace DarkId::Papyrus::DebugServer;
+
+namespace
+{
+	enum ArmedFlags : uint32_t
+	{
+		kArmedNone = 0,
+		kArmedBreakpoints = 1 << 0
+	};
+
+	// FunctionBreakpointTable, keyed by plain function addresses
+	class BreakpointTable
+	{
+	public:
+		struct Entry
+		{
+			const void* function = nullptr;
+			std::vector<uint64_t> instructionBits;
+		};
+
+		explicit BreakpointTable(const std::vector<const void*>& functions) : m_slots(functions.size() * 4)
+		{
+			for (const auto function : functions)
+			{
+				auto index = GetSlotIndex(function);
+				while (m_slots[index].function)
+				{
+					index = (index + 1) & (m_slots.size() - 1);
+				}
+				m_slots[index].function = function;
+			}
+		}
+
+		const Entry* Find(const void* function) const
+		{
+			for (auto index = GetSlotIndex(function);; index = (index + 1) & (m_slots.size() - 1))
+			{
+				if (!m_slots[index].function)
+				{
+					return nullptr;
+				}
+				if (m_slots[index].function == function)
+				{
+					return &m_slots[index];
+				}
+			}
+		}
+	private:
+		std::vector<Entry> m_slots;
+
+		size_t GetSlotIndex(const void* function) const
+		{
+			const auto hash = (reinterpret_cast<uintptr_t>(function) >> 4) * 0x9E3779B97F4A7C15ull;
+			return static_cast<size_t>(hash >> 32) & (m_slots.size() - 1);
+		}
+	};
+
+	struct Debugger
+	{
+		std::atomic<uint32_t> armedState = kArmedNone;
+		std::atomic<bool> pauseAll = false;
+		StackIdSet releasedStacks;
+		StackIdSet steppingStacks;
+		std::atomic<std::shared_ptr<const BreakpointTable>> breakpoints;
+		std::atomic<uint64_t> breakpointsVersion = 0;
+		// what the table lookup took before it was published as a snapshot
+		std::shared_mutex breakpointsMutex;
+		const BreakpointTable* lockedBreakpoints = nullptr;
+		// what every instruction took before the armed word
+		std::mutex instructionMutex;
+	};
+
+	struct Tasklet
+	{
+		uint32_t stackId;
+		const void* function;
+		uint32_t ip;
+	};
+
+	struct CachedBreakpoints
+	{
+		uint64_t version = 0;
+		std::shared_ptr<const BreakpointTable> table;
+	};
+	thread_local CachedBreakpoints t_breakpoints;
+
+	bool HasBreakpointAt(const BreakpointTable::Entry* entry, const uint32_t ip)
+	{
+		if (!entry || entry->instructionBits.empty())
+		{
+			return false;
+		}
+		const auto word = ip / 64;
+		return word < entry->instructionBits.size() && (entry->instructionBits[word] >> (ip % 64)) & 1;
+	}
+
+	bool IsAtBreakpoint(Debugger& debugger, const Tasklet& tasklet)
+	{
+		auto& cached = t_breakpoints;
+		const auto version = debugger.breakpointsVersion.load(std::memory_order_acquire);
+		if (cached.version != version)
+		{
+			cached.table = debugger.breakpoints.load();
+			cached.version = version;
+		}
+		return HasBreakpointAt(cached.table->Find(tasklet.function), tasklet.ip);
+	}
+
+	bool IsAtBreakpointShared(Debugger& debugger, const Tasklet& tasklet)
+	{
+		std::shared_lock lock(debugger.breakpointsMutex);
+		return HasBreakpointAt(debugger.lockedBreakpoints->Find(tasklet.function), tasklet.ip);
+	}
+
+	// HandleInstruction up to the point where it would stop, for a stack that doesn't
+	template <bool sharedLock>
+	bool HandleInstruction(Debugger& debugger, const Tasklet& tasklet)
+	{
+		if (debugger.armedState.load(std::memory_order_relaxed) == kArmedNone)
+		{
+			return false;
+		}
+
+		const bool paused = debugger.pauseAll.load(std::memory_order_acquire) && !debugger.releasedStacks.Contains(tasklet.stackId);
+		if (paused)
+		{
+			return true;
+		}
+		if (debugger.steppingStacks.Contains(tasklet.stackId))
+		{
+			return true;
+		}
+		return sharedLock ? IsAtBreakpointShared(debugger, tasklet) : IsAtBreakpoint(debugger, tasklet);
+	}
+
+	bool HandleInstructionLocked(Debugger& debugger, const Tasklet& tasklet)
+	{
+		std::lock_guard lock(debugger.instructionMutex);
+		return debugger.steppingStacks.Contains(tasklet.stackId);
+	}
+
+	enum class Mode
+	{
+		NoDebugger,
+		Idle,
+		Armed,
+		ArmedShared,
+		Locked
+	};
+
+	// A few dependent operations per instruction, so the hook's cost is measured against something
+	template <Mode mode>
+	uint64_t RunStack(Debugger& debugger, const uint32_t stackId, const void* function, const uint64_t instructions)
+	{
+		Tasklet tasklet{ stackId, function, 0 };
+		uint64_t accumulator = stackId;
+		uint64_t stops = 0;
+		for (uint64_t i = 0; i < instructions; i++)
+		{
+			tasklet.ip = static_cast<uint32_t>(i & 0xFF);
+			if constexpr (mode == Mode::Idle || mode == Mode::Armed)
+			{
+				stops += HandleInstruction<false>(debugger, tasklet);
+			}
+			else if constexpr (mode == Mode::ArmedShared)
+			{
+				stops += HandleInstruction<true>(debugger, tasklet);
+			}
+			else if constexpr (mode == Mode::Locked)
+			{
+				stops += HandleInstructionLocked(debugger, tasklet);
+			}
+			accumulator = accumulator * 6364136223846793005ull + 1442695040888963407ull;
+			accumulator ^= accumulator >> 29;
+		}
+		return accumulator + stops;
+	}
+
+	template <Mode mode>
+	double Measure(Debugger& debugger, const std::vector<const void*>& functions, const size_t threadCount, const uint64_t instructions)
+	{
+		std::atomic<uint64_t> sink = 0;
+		std::atomic<size_t> ready = 0;
+		std::atomic<bool> go = false;
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < threadCount; i++)
+		{
+			threads.emplace_back([&, i]() {
+				ready++;
+				while (!go)
+				{
+					std::this_thread::yield();
+				}
+				sink += RunStack<mode>(debugger, static_cast<uint32_t>(i + 1), functions[i % functions.size()], instructions);
+			});
+		}
+		while (ready < threadCount)
+		{
+			std::this_thread::yield();
+		}
+
+		const auto start = std::chrono::steady_clock::now();
+		go = true;
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+		const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (sink == 42)
+		{
+			std::puts("");
+		}
+		return static_cast<double>(instructions * threadCount) / seconds;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const size_t threadCount = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : std::max(1u, std::thread::hardware_concurrency());
+	const uint64_t instructions = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 50'000'000;
+
+	// the running functions are in the table with no breakpoints of their own, like any function in a script that
+	// isn't the one being debugged
+	std::vector<int> functionStorage(64);
+	std::vector<const void*> functions;
+	for (auto& function : functionStorage)
+	{
+		functions.push_back(&function);
+	}
+	Debugger debugger;
+	debugger.breakpoints = std::make_shared<const BreakpointTable>(functions);
+	debugger.breakpointsVersion = 1;
+	debugger.lockedBreakpoints = debugger.breakpoints.load().get();
+	// some other stack is being stepped, so the set isn't trivially empty
+	debugger.steppingStacks.Insert(1'000'000);
+
+	std::printf("%zu threads, %llu instructions each, %u hardware threads\n", threadCount, static_cast<unsigned long long>(instructions), std::thread::hardware_concurrency());
+
+	const auto report = [&](const char* name, const double perSecond, const double baseline) {
+		std::printf("  %-34s %8.1f M instructions/s  %+6.2f ns/instruction\n", name, perSecond / 1e6,
+			baseline > 0 ? (1e9 / perSecond - 1e9 / baseline) * static_cast<double>(threadCount) : 0.0);
+	};
+
+	const auto none = Measure<Mode::NoDebugger>(debugger, functions, threadCount, instructions);
+	report("no debugger", none, 0);
+
+	debugger.armedState = kArmedNone;
+	report("attached, idle", Measure<Mode::Idle>(debugger, functions, threadCount, instructions), none);
+
+	debugger.armedState = kArmedBreakpoints;
+	report("attached, breakpoints elsewhere", Measure<Mode::Armed>(debugger, functions, threadCount, instructions), none);
+
+	report("  with a shared_lock on the table", Measure<Mode::ArmedShared>(debugger, functions, threadCount, instructions), none);
+
+	report("attached, mutex per instruction", Measure<Mode::Locked>(debugger, functions, threadCount, instructions), none);
+	return 0;
+}
@@ -0,0 +1,223 @@
+// Time to read and parse every .pex file under a directory with the real Pex::FileReader, once for each way the
+// debug server has fed it data:
+//
+//   - one byte at a time into a stringstream, which is what ReadPexResource used to do;
+//   - 64KB block reads into a reused buffer, parsed in place through SpanStreamBuf (resources in the game's archives);
+//   - the file mapped into memory, parsed in place through SpanStreamBuf (loose files; MappedFile on Windows).
+//
+// The files are read once before timing, so every mode runs against a warm file cache.
+//
+//   pex_parse_bench <directory with .pex files> [passes]
+
+#include "SpanStreamBuf.h"
+
+#include <Champollion/Pex/Binary.hpp>
+#include <Champollion/Pex/FileReader.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include "MappedFile.h"
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace DarkId::Papyrus::DebugServer;
+
+namespace
+{
+	constexpr size_t kPexReadChunkSize = 64 * 1024;
+
+#ifndef _WIN32
+	// Just the part of MappedFile the benchmark needs
+	class MappedFile
+	{
+	public:
+		MappedFile() = default;
+		~MappedFile() { Close(); }
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		bool Open(const std::filesystem::path& path)
+		{
+			Close();
+			const auto file = open(path.c_str(), O_RDONLY);
+			if (file < 0)
+			{
+				return false;
+			}
+
+			struct stat status;
+			// can't map an empty file
+			if (fstat(file, &status) != 0 || status.st_size == 0)
+			{
+				close(file);
+				return false;
+			}
+
+			const auto view = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+			close(file);
+			if (view == MAP_FAILED)
+			{
+				return false;
+			}
+			m_view = view;
+			m_size = static_cast<size_t>(status.st_size);
+			return true;
+		}
+
+		void Close()
+		{
+			if (m_view)
+			{
+				munmap(m_view, m_size);
+				m_view = nullptr;
+			}
+			m_size = 0;
+		}
+
+		std::span<const char> GetData() const { return { static_cast<const char*>(m_view), m_size }; }
+	private:
+		void* m_view = nullptr;
+		size_t m_size = 0;
+	};
+#endif
+
+	bool Parse(std::istream& input, const std::filesystem::path& path)
+	{
+		Pex::Binary binary;
+		Pex::FileReader reader(&input);
+		try {
+			reader.read(binary);
+		}
+		catch (const std::exception& e) {
+			std::fprintf(stderr, "%s: %s\n", path.string().c_str(), e.what());
+			return false;
+		}
+		return true;
+	}
+
+	bool ParseByteStream(const std::filesystem::path& path)
+	{
+		std::ifstream file(path, std::ios::binary);
+		std::stringstream buffer;
+		char c;
+		while (file.get(c))
+		{
+			buffer.put(c);
+		}
+		return Parse(buffer, path);
+	}
+
+	bool ParseBlockRead(const std::filesystem::path& path)
+	{
+		// reused across files, as in WithPexData
+		thread_local std::vector<char> buffer;
+		std::ifstream file(path, std::ios::binary);
+		size_t size = 0;
+		while (true)
+		{
+			buffer.resize(size + kPexReadChunkSize);
+			file.read(buffer.data() + size, kPexReadChunkSize);
+			const auto read = static_cast<size_t>(file.gcount());
+			size += read;
+			if (read < kPexReadChunkSize)
+			{
+				break;
+			}
+		}
+		buffer.resize(size);
+
+		SpanStreamBuf streamBuf(buffer);
+		std::istream input(&streamBuf);
+		return Parse(input, path);
+	}
+
+	bool ParseMapped(const std::filesystem::path& path)
+	{
+		MappedFile file;
+		if (!file.Open(path))
+		{
+			return false;
+		}
+
+		SpanStreamBuf streamBuf(file.GetData());
+		std::istream input(&streamBuf);
+		return Parse(input, path);
+	}
+
+	template <typename TParse>
+	void Measure(const char* name, const std::vector<std::filesystem::path>& files, const uintmax_t totalBytes, const int passes, TParse parse)
+	{
+		size_t failures = 0;
+		const auto start = std::chrono::steady_clock::now();
+		for (int pass = 0; pass < passes; pass++)
+		{
+			for (const auto& file : files)
+			{
+				failures += !parse(file);
+			}
+		}
+		const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / passes;
+
+		std::printf("  %-28s %9.1f ms per pass  %8.1f us per file  %7.1f MB/s", name, seconds * 1e3,
+			seconds * 1e6 / static_cast<double>(files.size()), static_cast<double>(totalBytes) / seconds / 1e6);
+		if (failures)
+		{
+			std::printf("  (%zu failed)", failures / passes);
+		}
+		std::printf("\n");
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		std::fprintf(stderr, "usage: %s <directory with .pex files> [passes]\n", argv[0]);
+		return 1;
+	}
+	const auto passes = argc > 2 ? std::max(1, std::atoi(argv[2])) : 5;
+
+	std::vector<std::filesystem::path> files;
+	uintmax_t totalBytes = 0;
+	for (const auto& entry : std::filesystem::recursive_directory_iterator(argv[1]))
+	{
+		if (entry.is_regular_file() && entry.path().extension() == ".pex")
+		{
+			files.push_back(entry.path());
+			totalBytes += entry.file_size();
+		}
+	}
+	if (files.empty())
+	{
+		std::fprintf(stderr, "no .pex files under %s\n", argv[1]);
+		return 1;
+	}
+
+	std::printf("%zu files, %.1f MB, %d passes\n", files.size(), static_cast<double>(totalBytes) / 1e6, passes);
+
+	// warm the file cache so the first mode isn't the only one paying for the disk
+	for (const auto& file : files)
+	{
+		ParseBlockRead(file);
+	}
+
+	Measure("stringstream, byte at a time", files, totalBytes, passes, ParseByteStream);
+	Measure("block reads, in place", files, totalBytes, passes, ParseBlockRead);
+	Measure("mapped, in place", files, totalBytes, passes, ParseMapped);
+	return 0;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+// Stands in for the plugin's precompiled header, which needs CommonLib and the game, when the benchmarks build the
+// Protocol sources. Only the standard headers those sources rely on it for.
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
@@ -0,0 +1,234 @@
+// Round trips of large variables and source responses through the debug server's real transport: a cppdap session
+// bound to WebsocketServer and WebsocketReaderWriter, talking to a websocketpp client over loopback. The responses
+// are built once up front, so what's timed is cppdap's serialization, the reader/writer and the websocket itself.
+//
+//   websocket_loopback_bench [variables] [source KB] [requests] [port]
+
+#include "websocket_server.h"
+
+#include <websocketpp/client.hpp>
+#include <websocketpp/config/asio_no_tls_client.hpp>
+
+#include <dap/protocol.h>
+#include <dap/session.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+	using Client = websocketpp::client<websocketpp::config::asio_client>;
+
+	// Sends one DAP request per websocket message, as the editor does, and waits for the next response
+	class LoopbackClient
+	{
+	public:
+		LoopbackClient()
+		{
+			m_client.clear_access_channels(websocketpp::log::alevel::all);
+			m_client.clear_error_channels(websocketpp::log::elevel::all);
+			m_client.init_asio();
+			m_client.set_open_handler([this](websocketpp::connection_hdl hdl) {
+				std::lock_guard lock(m_mutex);
+				m_connection = hdl;
+				m_open = true;
+				m_condition.notify_all();
+			});
+			m_client.set_fail_handler([this](websocketpp::connection_hdl) {
+				std::lock_guard lock(m_mutex);
+				m_failed = true;
+				m_condition.notify_all();
+			});
+			m_client.set_message_handler([this](websocketpp::connection_hdl, Client::message_ptr message) {
+				std::lock_guard lock(m_mutex);
+				m_response = std::move(message->get_raw_payload());
+				m_condition.notify_all();
+			});
+		}
+
+		~LoopbackClient()
+		{
+			if (m_open)
+			{
+				websocketpp::lib::error_code error;
+				m_client.close(m_connection, websocketpp::close::status::normal, "done", error);
+			}
+			m_client.stop();
+			if (m_thread.joinable())
+			{
+				m_thread.join();
+			}
+		}
+
+		bool Connect(const int port)
+		{
+			// run() returns once a failed attempt leaves it nothing to do, so a retry has to start it again
+			if (m_thread.joinable())
+			{
+				m_thread.join();
+				m_client.reset();
+			}
+			m_failed = false;
+
+			websocketpp::lib::error_code error;
+			const auto connection = m_client.get_connection("ws://127.0.0.1:" + std::to_string(port), error);
+			if (error)
+			{
+				std::fprintf(stderr, "connect: %s\n", error.message().c_str());
+				return false;
+			}
+			m_client.connect(connection);
+			m_thread = std::thread([this]() { m_client.run(); });
+
+			std::unique_lock lock(m_mutex);
+			return m_condition.wait_for(lock, std::chrono::seconds(5), [this]() { return m_open || m_failed; }) && m_open;
+		}
+
+		std::optional<std::string> Request(const std::string& json)
+		{
+			std::unique_lock lock(m_mutex);
+			m_response.reset();
+			websocketpp::lib::error_code error;
+			m_client.send(m_connection, json, websocketpp::frame::opcode::text, error);
+			if (error)
+			{
+				std::fprintf(stderr, "send: %s\n", error.message().c_str());
+				return std::nullopt;
+			}
+			if (!m_condition.wait_for(lock, std::chrono::seconds(30), [this]() { return m_response.has_value(); }))
+			{
+				return std::nullopt;
+			}
+			return std::move(m_response);
+		}
+	private:
+		Client m_client;
+		std::thread m_thread;
+		std::mutex m_mutex;
+		std::condition_variable m_condition;
+		websocketpp::connection_hdl m_connection;
+		bool m_open = false;
+		bool m_failed = false;
+		std::optional<std::string> m_response;
+	};
+
+	dap::VariablesResponse MakeVariables(const int count)
+	{
+		dap::VariablesResponse response;
+		response.variables.reserve(count);
+		for (int i = 0; i < count; i++)
+		{
+			// roughly what an array of forms looks like in the variables view
+			response.variables.push_back(dap::Variable{
+				.name = std::to_string(i),
+				.type = "Actor",
+				.value = "[Actor < (" + std::to_string(0x14000 + i) + ")>]",
+				.variablesReference = i + 1
+			});
+		}
+		return response;
+	}
+
+	dap::SourceResponse MakeSource(const size_t kilobytes)
+	{
+		// decompiled Papyrus: short indented lines, with quotes and tabs for the JSON writer to escape
+		static constexpr char kLine[] = "\tif akActor.GetActorValue(\"Health\") > 0.0 ; still standing\n";
+		dap::SourceResponse response;
+		response.content.reserve(kilobytes * 1024 + sizeof(kLine));
+		while (response.content.size() < kilobytes * 1024)
+		{
+			response.content += kLine;
+		}
+		return response;
+	}
+
+	template <typename TMakeRequest>
+	void Measure(LoopbackClient& client, const char* name, const TMakeRequest& makeRequest, const int requests)
+	{
+		// one untimed round trip, so connection setup and first-use allocations aren't counted
+		if (!client.Request(makeRequest(0)))
+		{
+			std::fprintf(stderr, "%s: no response\n", name);
+			return;
+		}
+
+		size_t bytes = 0;
+		const auto start = std::chrono::steady_clock::now();
+		for (int i = 1; i <= requests; i++)
+		{
+			const auto response = client.Request(makeRequest(i));
+			if (!response)
+			{
+				std::fprintf(stderr, "%s: no response to request %d\n", name, i);
+				return;
+			}
+			bytes += response->size();
+		}
+		const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::printf("  %-10s %10zu bytes per response  %8.2f ms per request  %8.1f MB/s\n", name, bytes / requests,
+			seconds * 1e3 / requests, static_cast<double>(bytes) / seconds / 1e6);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const auto variableCount = argc > 1 ? std::atoi(argv[1]) : 10000;
+	const auto sourceKilobytes = static_cast<size_t>(argc > 2 ? std::atoi(argv[2]) : 1024);
+	const auto requests = argc > 3 ? std::max(1, std::atoi(argv[3])) : 50;
+	const auto port = argc > 4 ? std::atoi(argv[4]) : 43299;
+
+	const auto variables = MakeVariables(variableCount);
+	const auto source = MakeSource(sourceKilobytes);
+
+	std::mutex sessionMutex;
+	std::shared_ptr<dap::Session> session;
+	dap::net::WebsocketServer server;
+	server.start(port, [&](const std::shared_ptr<dap::ReaderWriter>& connection) {
+		auto created = std::shared_ptr<dap::Session>(dap::Session::create());
+		created->registerHandler([&](const dap::VariablesRequest&) -> dap::ResponseOrError<dap::VariablesResponse> {
+			return variables;
+		});
+		created->registerHandler([&](const dap::SourceRequest&) -> dap::ResponseOrError<dap::SourceResponse> {
+			return source;
+		});
+		created->bind(connection);
+		std::lock_guard lock(sessionMutex);
+		session = std::move(created);
+	}, [](const char* message) {
+		std::fprintf(stderr, "server: %s\n", message);
+	});
+
+	LoopbackClient client;
+	// the server starts listening on its own thread
+	bool connected = false;
+	for (int attempt = 0; attempt < 20 && !connected; attempt++)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		connected = client.Connect(port);
+	}
+	if (!connected)
+	{
+		std::fprintf(stderr, "could not connect to the server on port %d\n", port);
+		return 1;
+	}
+
+	std::printf("%d variables, %zu KB source, %d requests, %u hardware threads\n", variableCount, sourceKilobytes, requests, std::thread::hardware_concurrency());
+	Measure(client, "variables", [](const int seq) {
+		return "{\"seq\":" + std::to_string(seq) + ",\"type\":\"request\",\"command\":\"variables\",\"arguments\":{\"variablesReference\":1}}";
+	}, requests);
+	Measure(client, "source", [](const int seq) {
+		return "{\"seq\":" + std::to_string(seq) + ",\"type\":\"request\",\"command\":\"source\",\"arguments\":{\"sourceReference\":1}}";
+	}, requests);
+
+	server.stop();
+	return 0;
+}
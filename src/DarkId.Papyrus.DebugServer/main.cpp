@@ -20,6 +20,7 @@ namespace XSE = F4SE;
 #include "DebugServer.h"
 #include "ConfigHooks.h"
 #include "RuntimeEvents.h"
+#include "ScriptIdentityCache.h"
 using namespace DarkId::Papyrus::DebugServer;
 
 DebugServer* g_debugServer;
@@ -45,6 +46,12 @@ void MessageHandler(XSE::MessagingInterface::Message* msg)
 
 			break;
 		}
+		case XSE::MessagingInterface::kPreLoadGame:
+		{
+			// loading a save can unload script types, so their addresses mean nothing afterwards
+			ScriptIdentityCache::GetSingleton().ClearLookups();
+			break;
+		}
 	}
 }
 